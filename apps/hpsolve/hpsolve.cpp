@@ -24,11 +24,17 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include <fstream>
 
 #include <hpsat.h>
 
@@ -36,16 +42,35 @@ static hpsat_var_t vm;
 static uint8_t *psol;
 static bool first = true;
 static size_t nsol;
+static int order = HPSAT_ORDER_INDEX;
+static size_t budget;
+static EQ_CNF *pcnf;
+static uint8_t *pext;
+static bool aiger;
+static bool preprocess;
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: cat xxx.cnf | hpsolve [-ch]\n");
+	fprintf(stderr,
+	    "Usage: cat xxx.cnf | hpsolve [-achp] [-b nodes] [-o order]\n"
+	    "       hpsolve [-achp] [-b nodes] [-o order] xxx.cnf\n"
+	    "\t-a  the input is an AIGER circuit, satisfied by any output\n"
+	    "\t-b nodes  give up when the expression grows beyond this size\n"
+	    "\t-p  preprocess the clauses, can not be used with -a or -c\n"
+	    "\t-o index|occurrence|degree|fill  variable elimination order\n");
 }
 
 static bool
 callback(const uint8_t *psol, void *arg)
 {
+	/* recover the eliminated variables */
+	if (pcnf != 0) {
+		memcpy(pext, psol, vm);
+		pcnf->extend(pext);
+		psol = pext;
+	}
+
 	printf("s SATISFIABLE\n" "v ");
 
 	for (hpsat_var_t v = HPSAT_VAR_MIN; v < vm; v++) {
@@ -62,43 +87,135 @@ callback(const uint8_t *psol, void *arg)
 	return (first);
 }
 
+template <typename T>
+static int
+load(EQ &eq, EQ_CNF &cnf, T &in)
+{
+	if (aiger)
+		return (eq.from_aiger(in));
+	else if (preprocess)
+		return (cnf.from_cnf(in));
+	else
+		return (eq.from_cnf(in));
+}
+
 int
 main(int argc, char **argv)
 {
+	struct stat st;
+	int fd = STDIN_FILENO;
+	int error;
 	int c;
 
 	signal(SIGPIPE, SIG_IGN);
 
-	while ((c = getopt(argc, argv, "ch")) != -1) {
+	while ((c = getopt(argc, argv, "ab:cho:p")) != -1) {
 		switch (c) {
+		case 'a':
+			aiger = true;
+			break;
+		case 'b':
+			budget = strtoull(optarg, 0, 0);
+			break;
 		case 'c':
 			first = false;
 			break;
+		case 'o':
+			if (strcmp(optarg, "index") == 0) {
+				order = HPSAT_ORDER_INDEX;
+			} else if (strcmp(optarg, "occurrence") == 0) {
+				order = HPSAT_ORDER_OCCURRENCE;
+			} else if (strcmp(optarg, "degree") == 0) {
+				order = HPSAT_ORDER_DEGREE;
+			} else if (strcmp(optarg, "fill") == 0) {
+				order = HPSAT_ORDER_FILL;
+			} else {
+				usage();
+				return (1);
+			}
+			break;
+		case 'p':
+			preprocess = true;
+			break;
 		default:
 			usage();
 			return (0);
 		}
 	}
 
+	argc -= optind;
+	argv += optind;
+
+	/* preprocessing does not keep the number of solutions */
+	if (preprocess && (aiger || !first)) {
+		usage();
+		return (1);
+	}
+
+	if (argc > 0) {
+		fd = open(argv[0], O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Cannot open '%s'\n", argv[0]);
+			return (1);
+		}
+	}
+
 	EQ eq;
+	EQ_CNF cnf;
+
+	/* regular files are memory mapped */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		error = load(eq, cnf, fd);
+	} else if (argc > 0) {
+		std::ifstream in(argv[0]);
+		error = load(eq, cnf, in);
+	} else {
+		error = load(eq, cnf, std::cin);
+	}
+
+	if (fd != STDIN_FILENO)
+		close(fd);
 
-	if (eq.from_cnf(std::cin) != 0) {
-		fprintf(stderr, "Failed to load CNF\n");
+	if (error != 0) {
+		fprintf(stderr, "Failed to load %s\n", aiger ? "AIGER" : "CNF");
 		return (1);
 	}
 
-	vm = eq.maxVar() + 1;
+	if (preprocess) {
+		cnf.preprocess();
+		fprintf(stderr, "c Preprocessed clauses = %zu\n", cnf.size());
+		eq = cnf.toEQ();
+		vm = cnf.maxVar() + 1;
+		pcnf = &cnf;
+		pext = new uint8_t [vm];
+	} else {
+		vm = eq.maxVar() + 1;
+		if (vm < HPSAT_VAR_MIN)
+			vm = HPSAT_VAR_MIN;
+	}
 
 	uint8_t *psol = new uint8_t [vm];
+	hpsat_var_t *porder = new hpsat_var_t [vm - HPSAT_VAR_MIN];
+
+	hpsat_order(eq, vm, porder, order);
 
-	if (eq.solve(psol, vm, &callback, 0) == false) {
+	switch (eq.solve(psol, vm, &callback, 0, porder, budget)) {
+	case HPSAT_UNSAT:
 		if (first)
 			printf("UNSATISFIABLE\n");
 		else
 			printf("s SOLUTIONS %zu\n", nsol);
+		break;
+	case HPSAT_UNKNOWN:
+		printf("s UNKNOWN\n");
+		break;
+	default:
+		break;
 	}
 
 	delete [] psol;
+	delete [] porder;
+	delete [] pext;
 
 	return (0);
 }
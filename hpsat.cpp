@@ -25,6 +25,15 @@
 
 #include "hpsat.h"
 
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
 void
 hpsat_free(EQ_HEAD_t *phead)
 {
@@ -34,8 +43,140 @@ hpsat_free(EQ_HEAD_t *phead)
 		delete peq->remove(phead);
 }
 
+static size_t
+hpsat_lane_bits(size_t nword)
+{
+	size_t lbits = 6;
+
+	while ((1UL << (lbits - 6)) < nword)
+		lbits++;
+	return (lbits);
+}
+
+/*
+ * Fill in the bit-sliced values of the given variables for one block
+ * of assignments. Assignment number "x" within the block is given by
+ * bit "x % 64" of word "x / 64". The lowest variable toggles fastest.
+ */
+static void
+hpsat_slice(uint64_t *pw, size_t nword, const hpsat_var_t *pvars, size_t nvars,
+    uint64_t block)
+{
+	static const uint64_t mask[6] = {
+		0xAAAAAAAAAAAAAAAAULL,
+		0xCCCCCCCCCCCCCCCCULL,
+		0xF0F0F0F0F0F0F0F0ULL,
+		0xFF00FF00FF00FF00ULL,
+		0xFFFF0000FFFF0000ULL,
+		0xFFFFFFFF00000000ULL,
+	};
+	const size_t lbits = hpsat_lane_bits(nword);
+
+	for (size_t x = 0; x != nvars; x++) {
+		uint64_t *pv = pw + pvars[x] * nword;
+
+		for (size_t w = 0; w != nword; w++) {
+			if (x < 6)
+				pv[w] = mask[x];
+			else if (x < lbits)
+				pv[w] = ((w >> (x - 6)) & 1) ? -1ULL : 0;
+			else
+				pv[w] = ((block >> (x - lbits)) & 1) ?
+				    -1ULL : 0;
+		}
+	}
+}
+
+struct hpsat_verify_ctx {
+	const EQC *pa;
+	const EQC *pb;
+	const EQC *pc;
+	const hpsat_var_t *pvars;
+	size_t nvars;
+	hpsat_var_t vm;
+	size_t nword;
+	uint64_t nblock;
+	size_t nwork;
+	uint8_t function;
+	uint8_t *pcex;
+	std::atomic<bool> failed;
+};
+
+static void
+hpsat_verify_work(size_t index, void *arg)
+{
+	hpsat_verify_ctx &ctx = *(hpsat_verify_ctx *)arg;
+	const size_t nword = ctx.nword;
+	const uint64_t step = ctx.nblock / ctx.nwork;
+	const uint64_t rem = ctx.nblock % ctx.nwork;
+	const uint64_t start = index * step + (index < rem ? index : rem);
+	const uint64_t end = start + step + (index < rem);
+	uint64_t *pw = new uint64_t [ctx.vm * nword];
+	uint64_t ra[8];
+	uint64_t rb[8];
+	uint64_t rc[8];
+
+	memset(pw, 0, sizeof(pw[0]) * ctx.vm * nword);
+
+	for (uint64_t n = start; n != end &&
+	    !ctx.failed.load(std::memory_order_relaxed); n++) {
+		hpsat_slice(pw, nword, ctx.pvars, ctx.nvars, n);
+
+		ctx.pa->eval(pw, ra, nword);
+		ctx.pb->eval(pw, rb, nword);
+		ctx.pc->eval(pw, rc, nword);
+
+		for (size_t w = 0; w != nword; w++) {
+			uint64_t diff;
+
+			switch (ctx.function) {
+			case 0:
+				diff = (ra[w] ^ rb[w]) ^ rc[w];
+				break;
+			case 1:
+				diff = (ra[w] | rb[w]) ^ rc[w];
+				break;
+			case 2:
+				diff = (ra[w] & rb[w]) ^ rc[w];
+				break;
+			default:
+				diff = 0;
+				break;
+			}
+
+			if (diff == 0)
+				continue;
+
+			/* only the first failing worker reports */
+			if (ctx.failed.exchange(true) == false &&
+			    ctx.pcex != 0) {
+				const size_t lane = __builtin_ctzll(diff);
+
+				memset(ctx.pcex, 0,
+				    sizeof(ctx.pcex[0]) * ctx.vm);
+				for (size_t x = 0; x != ctx.nvars; x++) {
+					const hpsat_var_t v = ctx.pvars[x];
+
+					ctx.pcex[v] =
+					    (pw[v * nword + w] >> lane) & 1;
+				}
+			}
+			break;
+		}
+	}
+
+	delete [] pw;
+}
+
+/*
+ * Check that "c" equals "a ^ b", "a | b" or "a & b" for all
+ * assignments, selected by "function" being 0, 1 or 2. If "pcex" is
+ * non-NULL, it must have room for the highest used variable plus one
+ * and receives an assignment which fails the check.
+ */
 bool
-hpsat_verify(const EQ &a, const EQ &b, const EQ &c, uint8_t function)
+hpsat_verify(const EQ &a, const EQ &b, const EQ &c, uint8_t function,
+    uint8_t *pcex)
 {
 	hpsat_var_t vm = HPSAT_VAR_MIN - 1;
 	hpsat_var_t v;
@@ -53,180 +194,371 @@ hpsat_verify(const EQ &a, const EQ &b, const EQ &c, uint8_t function)
 	vm++;
 
 	uint8_t *pused = new uint8_t [vm];
-	uint8_t *pval = new uint8_t [vm];
+	hpsat_var_t *pvars = new hpsat_var_t [vm];
+	size_t nvars = 0;
 
 	memset(pused, 0, sizeof(pused[0]) * vm);
-	memset(pval, 0, sizeof(pval[0]) * vm);
 
 	a.usedVar(pused);
 	b.usedVar(pused);
 	c.usedVar(pused);
 
-	for (;;) {
-		hpsat_var_t z;
+	for (v = HPSAT_VAR_MIN; v != vm; v++) {
+		if (pused[v])
+			pvars[nvars++] = v;
+	}
 
-		switch (function) {
-		case 0:
-			if ((a.expand_all(pval) ^ b.expand_all(pval)) != c.expand_all(pval))
-				return (false);
-			break;
-		case 1:
-			if ((a.expand_all(pval) || b.expand_all(pval)) != c.expand_all(pval))
-				return (false);
-			break;
-		case 2:
-			if ((a.expand_all(pval) && b.expand_all(pval)) != c.expand_all(pval))
-				return (false);
-			break;
-		default:
-			break;
+	const EQC ca(a);
+	const EQC cb(b);
+	const EQC cc(c);
+
+	hpsat_verify_ctx ctx;
+
+	ctx.pa = &ca;
+	ctx.pb = &cb;
+	ctx.pc = &cc;
+	ctx.pvars = pvars;
+	ctx.nvars = nvars;
+	ctx.vm = vm;
+	ctx.nword = EQC::words();
+	ctx.function = function;
+	ctx.pcex = pcex;
+	ctx.failed = false;
+
+	/* split the assignments into ranges of blocks */
+	const size_t lbits = hpsat_lane_bits(ctx.nword);
+
+	if (nvars <= lbits)
+		ctx.nblock = 1;
+	else if (nvars - lbits < 63)
+		ctx.nblock = 1ULL << (nvars - lbits);
+	else
+		ctx.nblock = 1ULL << 63;
+
+	ctx.nwork = 8 * hpsat_nthreads();
+	if (ctx.nwork > ctx.nblock)
+		ctx.nwork = ctx.nblock;
+
+	hpsat_parallel(ctx.nwork, &hpsat_verify_work, &ctx);
+
+	delete [] pused;
+	delete [] pvars;
+
+	return (ctx.failed == false);
+}
+
+/*
+ * The traversals below use an explicit stack instead of recursion, so
+ * that they work for expressions of any depth, also in threads with
+ * small stacks. A frame holds a node and the next child to visit.
+ */
+
+struct hpsat_walk {
+	EQ *pe;
+	EQ *pnext;
+};
+
+struct hpsat_copy_frame {
+	const EQ *psrc;
+	EQ *pdst;
+	const EQ *pnext;
+};
+
+EQ :: EQ(const EQ &other)
+{
+	hpsat_stack<hpsat_copy_frame> stack;
+
+	TAILQ_INIT(&head);
+	var = other.var;
+	stack.push({ &other, this, other.first() });
+
+	while (!stack.empty()) {
+		hpsat_copy_frame &f = stack.top();
+		const EQ *pc = f.pnext;
+
+		if (pc == 0) {
+			f.pdst->update();
+			stack.pop();
+			continue;
 		}
+		f.pnext = pc->next();
 
-		for (z = HPSAT_VAR_MIN; z != vm; z++) {
-			if (pused[z] == 0)
-				continue;
-			pval[z] ^= true;
-			if (pval[z])
-				break;
+		EQ *pn = new EQ(pc->var);
+
+		pn->insert_tail(&f.pdst->head);
+		if (pc->first() != 0)
+			stack.push({ pc, pn, pc->first() });
+	}
+}
+
+bool
+EQ :: contains(hpsat_var_t _var) const
+{
+	hpsat_stack<EQ *> stack;
+
+	if (_var > vmax)
+		return (false);
+	if (var == _var)
+		return (true);
+
+	stack.push(first());
+
+	while (!stack.empty()) {
+		EQ *pc = stack.top();
+
+		if (pc == 0) {
+			stack.pop();
+			continue;
 		}
-		if (z == vm)
-			break;
+		stack.top() = pc->next();
+
+		if (_var > pc->vmax)
+			continue;
+		if (pc->var == _var)
+			return (true);
+		if (pc->first() != 0)
+			stack.push(pc->first());
 	}
+	return (false);
+}
 
-	delete [] pused;
-	delete [] pval;
+hpsat_var_t
+EQ :: usedVar(uint8_t *pval) const
+{
+	hpsat_stack<const EQ *> stack;
+	hpsat_var_t retval = 0;
 
-	return (true);
+	stack.push(this);
+
+	while (!stack.empty()) {
+		const EQ *pe = stack.top();
+
+		stack.pop();
+		retval += (pval[pe->var] == 0);
+		pval[pe->var] = 1;
+
+		for (EQ *peq = pe->first(); peq; peq = peq->next())
+			stack.push(peq);
+	}
+	return (retval);
+}
+
+/*
+ * Put two detached operands into the group "temp", smaller first, and
+ * sort it. Operands which are not needed any more are moved into
+ * place instead of being copied.
+ */
+static void
+hpsat_group(EQ &temp, EQ *pa, EQ *pb)
+{
+	if (pa->compare(*pb) > 0)
+		HPSAT_SWAP(pa, pb);
+
+	pa->insert_tail(&temp.head);
+	pb->insert_tail(&temp.head);
+	temp.sort();
+}
+
+EQ
+EQ :: operator !() const &
+{
+	EQ temp(*this);
+
+	temp ^= EQ(HPSAT_VAR_ONE);
+	return (temp);
 }
 
 EQ
-EQ :: operator !() const
+EQ :: operator !() &&
 {
-	EQ one(HPSAT_VAR_ONE);
-	return (one ^ *this);
+	*this ^= EQ(HPSAT_VAR_ONE);
+	return (std::move(*this));
 }
 
 EQ &
 EQ :: operator |=(const EQ &other)
 {
-	EQ temp(HPSAT_VAR_ORED);
-	EQ *pa = new EQ();
-	EQ *pb = new EQ();
+	return (*this |= EQ(other));
+}
 
-	pa->insert_tail(&temp.head);
-	pb->insert_tail(&temp.head);
+EQ &
+EQ :: operator |=(EQ &&other)
+{
+	EQ temp(HPSAT_VAR_ORED);
 
-	if (compare(other) < 0) {
-		*pa = *this;
-		*pb = EQ(other);
-	} else {
-		*pa = EQ(other);
-		*pb = *this;
-	}
-	*this = temp.sort();
+	hpsat_group(temp, new EQ(std::move(*this)), new EQ(std::move(other)));
+	*this = temp;
 	return (*this);
 }
 
 EQ
-EQ :: operator |(const EQ &other) const
+EQ :: operator |(const EQ &other) const &
 {
-	EQ temp(HPSAT_VAR_ORED);
-	EQ *pa = new EQ();
-	EQ *pb = new EQ();
+	EQ temp(*this);
 
-	pa->insert_tail(&temp.head);
-	pb->insert_tail(&temp.head);
+	temp |= other;
+	return (temp);
+}
 
-	if (compare(other) < 0) {
-		*pa = EQ(*this);
-		*pb = EQ(other);
-	} else {
-		*pa = EQ(other);
-		*pb = EQ(*this);
-	}
-	return (temp.sort());
+EQ
+EQ :: operator |(EQ &&other) const &
+{
+	EQ temp(*this);
+
+	temp |= std::move(other);
+	return (temp);
+}
+
+EQ
+EQ :: operator |(const EQ &other) &&
+{
+	*this |= other;
+	return (std::move(*this));
+}
+
+EQ
+EQ :: operator |(EQ &&other) &&
+{
+	*this |= std::move(other);
+	return (std::move(*this));
 }
 
 EQ &
 EQ :: operator ^=(const EQ &other)
 {
-	EQ temp(HPSAT_VAR_XORED);
-	EQ *pa = new EQ();
-	EQ *pb = new EQ();
+	return (*this ^= EQ(other));
+}
 
-	pa->insert_tail(&temp.head);
-	pb->insert_tail(&temp.head);
+EQ &
+EQ :: operator ^=(EQ &&other)
+{
+	EQ temp(HPSAT_VAR_XORED);
 
-	if (compare(other) < 0) {
-		*pa = *this;
-		*pb = EQ(other);
-	} else {
-		*pa = EQ(other);
-		*pb = *this;
-	}
-	*this = temp.sort();
+	hpsat_group(temp, new EQ(std::move(*this)), new EQ(std::move(other)));
+	*this = temp;
 	return (*this);
 }
 
 EQ
-EQ :: operator ^(const EQ &other) const
+EQ :: operator ^(const EQ &other) const &
 {
-	EQ temp(HPSAT_VAR_XORED);
-	EQ *pa = new EQ();
-	EQ *pb = new EQ();
+	EQ temp(*this);
 
-	pa->insert_tail(&temp.head);
-	pb->insert_tail(&temp.head);
+	temp ^= other;
+	return (temp);
+}
 
-	if (compare(other) < 0) {
-		*pa = EQ(*this);
-		*pb = EQ(other);
-	} else {
-		*pa = EQ(other);
-		*pb = EQ(*this);
-	}
-	return (temp.sort());
+EQ
+EQ :: operator ^(EQ &&other) const &
+{
+	EQ temp(*this);
+
+	temp ^= std::move(other);
+	return (temp);
+}
+
+EQ
+EQ :: operator ^(const EQ &other) &&
+{
+	*this ^= other;
+	return (std::move(*this));
+}
+
+EQ
+EQ :: operator ^(EQ &&other) &&
+{
+	*this ^= std::move(other);
+	return (std::move(*this));
 }
 
 EQ &
 EQ :: operator &=(const EQ &other)
 {
-	EQ temp(HPSAT_VAR_ANDED);
-	EQ *pa = new EQ();
-	EQ *pb = new EQ();
+	return (*this &= EQ(other));
+}
 
-	pa->insert_tail(&temp.head);
-	pb->insert_tail(&temp.head);
+EQ &
+EQ :: operator &=(EQ &&other)
+{
+	EQ temp(HPSAT_VAR_ANDED);
 
-	if (compare(other) < 0) {
-		*pa = *this;
-		*pb = EQ(other);
-	} else {
-		*pa = EQ(other);
-		*pb = *this;
-	}
-	*this = temp.sort();
+	hpsat_group(temp, new EQ(std::move(*this)), new EQ(std::move(other)));
+	*this = temp;
 	return (*this);
 }
 
 EQ
-EQ :: operator &(const EQ &other) const
+EQ :: operator &(const EQ &other) const &
 {
-	EQ temp(HPSAT_VAR_ANDED);
-	EQ *pa = new EQ();
-	EQ *pb = new EQ();
+	EQ temp(*this);
 
-	pa->insert_tail(&temp.head);
-	pb->insert_tail(&temp.head);
+	temp &= other;
+	return (temp);
+}
 
-	if (compare(other) < 0) {
-		*pa = EQ(*this);
-		*pb = EQ(other);
-	} else {
-		*pa = EQ(other);
-		*pb = EQ(*this);
-	}
-	return (temp.sort());
+EQ
+EQ :: operator &(EQ &&other) const &
+{
+	EQ temp(*this);
+
+	temp &= std::move(other);
+	return (temp);
+}
+
+EQ
+EQ :: operator &(const EQ &other) &&
+{
+	*this &= other;
+	return (std::move(*this));
+}
+
+EQ
+EQ :: operator &(EQ &&other) &&
+{
+	*this &= std::move(other);
+	return (std::move(*this));
+}
+
+/*
+ * Build a group of type "op" from any number of operands in a single
+ * pass. The group is sorted once, instead of once per operand as when
+ * joining the operands one by one. A group without operands is the
+ * identity of "op".
+ */
+EQ
+EQ :: build(hpsat_var_t op, const EQ *peq, size_t num)
+{
+	EQ temp(op);
+
+	assert(op == HPSAT_VAR_ORED || op == HPSAT_VAR_XORED ||
+	    op == HPSAT_VAR_ANDED);
+
+	for (size_t x = 0; x != num; x++)
+		peq[x].dup()->insert_tail(&temp.head);
+	temp.sort();
+	return (temp);
+}
+
+EQ
+EQ :: build(hpsat_var_t op, const std::vector<EQ> &other)
+{
+	return (build(op, other.data(), other.size()));
+}
+
+/* the operands are moved into the group */
+EQ
+EQ :: build(hpsat_var_t op, std::vector<EQ> &&other)
+{
+	EQ temp(op);
+
+	assert(op == HPSAT_VAR_ORED || op == HPSAT_VAR_XORED ||
+	    op == HPSAT_VAR_ANDED);
+
+	for (EQ &eq : other)
+		(new EQ(std::move(eq)))->insert_tail(&temp.head);
+	other.clear();
+	temp.sort();
+	return (temp);
 }
 
 static void
@@ -279,98 +611,230 @@ hpsat_merge(EQ_HEAD_t *pah, EQ_HEAD_t *pbh, EQ_HEAD_t *pch, bool isXor)
 	}
 }
 
-EQ &
-EQ :: sort()
+/*
+ * Bottom-up merge sort of a list, by relinking only. Equal elements are
+ * cancelled or joined by hpsat_merge() while merging.
+ */
+static void
+hpsat_sort(EQ_HEAD_t *phead, bool isXor)
 {
+	EQ_HEAD_t bins[64];
 	EQ_HEAD_t temp;
+	EQ_HEAD_t merged;
+	size_t nbins = 0;
+	size_t x;
+	EQ *peq;
+
+	while ((peq = TAILQ_FIRST(phead))) {
+		TAILQ_INIT(&temp);
+		peq->remove(phead)->insert_tail(&temp);
+
+		for (x = 0; x != nbins && !TAILQ_EMPTY(&bins[x]); x++) {
+			hpsat_merge(&bins[x], &temp, &merged, isXor);
+			TAILQ_CONCAT(&temp, &merged, entry);
+		}
+		if (x == nbins) {
+			TAILQ_INIT(&bins[x]);
+			nbins++;
+		}
+		TAILQ_CONCAT(&bins[x], &temp, entry);
+	}
+
+	TAILQ_INIT(&temp);
+	for (x = 0; x != nbins; x++) {
+		hpsat_merge(&bins[x], &temp, &merged, isXor);
+		TAILQ_CONCAT(&temp, &merged, entry);
+	}
+	TAILQ_CONCAT(phead, &temp, entry);
+}
+
+/*
+ * Sort one node, whose children must already be sorted.
+ */
+static void
+hpsat_sort_node(EQ &eq)
+{
+	EQ_HEAD_t temp;
+	EQ_HEAD_t group;
 	EQ *peq;
 	EQ *pfq;
-	EQ *pgq;
-	EQ *phq;
 
-#if defined(DEBUG) && defined(VERIFY)
-	EQ copy(*this);
-#endif
-	if (first() == 0)
+	if (eq.first() == 0)
 		goto done;
 
-	assert(var == HPSAT_VAR_XORED || var == HPSAT_VAR_ORED || var == HPSAT_VAR_ANDED);
+	assert(eq.var == HPSAT_VAR_XORED || eq.var == HPSAT_VAR_ORED ||
+	    eq.var == HPSAT_VAR_ANDED);
 
-	/* recurse */
-	for (peq = first(); peq; peq = pfq) {
-		pfq = peq->sort().next();
+	for (peq = eq.first(); peq; peq = pfq) {
+		pfq = peq->next();
 
 		switch (peq->var) {
 		case HPSAT_VAR_ZERO:
-			if (var == HPSAT_VAR_ANDED)
+			if (eq.var == HPSAT_VAR_ANDED)
 				goto select;
 			else
-				delete peq->remove(&head);
+				delete peq->remove(&eq.head);
 			break;
 		case HPSAT_VAR_ONE:
-			if (var == HPSAT_VAR_ORED)
+			if (eq.var == HPSAT_VAR_ORED)
 				goto select;
-			else if (var == HPSAT_VAR_ANDED)
-				delete peq->remove(&head);
+			else if (eq.var == HPSAT_VAR_ANDED)
+				delete peq->remove(&eq.head);
 			break;
 		default:
 			break;
 		}
 	}
 
-	if (first() == 0)
+	if (eq.first() == 0)
 		goto done;
 
-	/* insertion sort */
-	for (peq = first()->next(); peq; peq = phq) {
-		phq = peq->next();
-
-		for (pfq = peq; pfq != first(); pfq = pgq) {
-			pgq = pfq->prev();
-
-			int cmp = pgq->compare(*pfq);
-
-			if (cmp > 0) {
-				HPSAT_SWAP(*pgq, *pfq);
-			} else if (cmp < 0) {
-				break;
-			} else {
-				if (var == HPSAT_VAR_XORED) {
-					delete pfq->remove(&head);
-					delete pgq->remove(&head);
-				} else {
-					delete pfq->remove(&head);
-				}
-				break;
-			}
-		}
-	}
+	/* merge sort */
+	hpsat_sort(&eq.head, eq.var == HPSAT_VAR_XORED);
 
 	/* join same group type */
-	for (peq = first(); peq; ) {
-		if (peq->var == var) {
-			peq->remove(&head);
-			hpsat_merge(&head, &peq->head, &temp, var == HPSAT_VAR_XORED);
-			delete peq;
-			TAILQ_CONCAT(&head, &temp, entry);
-			peq = first();
-		} else {
-			peq = peq->next();
-		}
+	TAILQ_INIT(&group);
+	for (peq = eq.first(); peq; peq = pfq) {
+		pfq = peq->next();
+		if (peq->var == eq.var)
+			peq->remove(&eq.head)->insert_tail(&group);
+	}
+	while ((peq = TAILQ_FIRST(&group))) {
+		peq->remove(&group);
+		hpsat_merge(&eq.head, &peq->head, &temp,
+		    eq.var == HPSAT_VAR_XORED);
+		delete peq;
+		TAILQ_CONCAT(&eq.head, &temp, entry);
 	}
 
 	/* pullup */
-	if ((peq = first())) {
+	if ((peq = eq.first())) {
 		if (peq->next() == 0) {
-			peq->remove(&head);
-			*this = *peq;
+			peq->remove(&eq.head);
+			eq = *peq;
 			delete peq;
 		}
 	}
 done:
 	/* check if group is empty */
-	if (first() == 0 && var < HPSAT_VAR_MIN)
-		var = (var == HPSAT_VAR_ONE || var == HPSAT_VAR_ANDED) ? HPSAT_VAR_ONE : HPSAT_VAR_ZERO;
+	if (eq.first() == 0 && eq.var < HPSAT_VAR_MIN) {
+		if (eq.var == HPSAT_VAR_ONE || eq.var == HPSAT_VAR_ANDED)
+			eq.var = HPSAT_VAR_ONE;
+		else
+			eq.var = HPSAT_VAR_ZERO;
+	}
+
+	eq.update();
+	return;
+
+select:
+	peq->remove(&eq.head);
+	eq = *peq;
+	delete peq;
+	goto done;
+}
+
+/* sort all nodes bottom up, children before their parents */
+static void
+hpsat_sort_tree(EQ &eq)
+{
+	hpsat_stack<hpsat_walk> stack;
+
+	stack.push({ &eq, eq.first() });
+
+	while (!stack.empty()) {
+		hpsat_walk &f = stack.top();
+		EQ *pc = f.pnext;
+
+		if (pc == 0) {
+			hpsat_sort_node(*f.pe);
+			stack.pop();
+			continue;
+		}
+		f.pnext = pc->next();
+
+		if (pc->first() != 0)
+			stack.push({ pc, pc->first() });
+		else
+			hpsat_sort_node(*pc);
+	}
+}
+
+/*
+ * Large expressions are sorted in parallel. The tree is split into
+ * enough independent subtrees to keep all threads busy, which are
+ * sorted in parallel. The nodes above them are then sorted bottom up
+ * without recursion.
+ */
+
+#define	HPSAT_SORT_PARALLEL (1UL << 14)	/* nodes */
+
+struct hpsat_sort_ctx {
+	std::vector<EQ *> leaf;
+	size_t nwork;
+};
+
+static void
+hpsat_sort_work(size_t index, void *arg)
+{
+	hpsat_sort_ctx &ctx = *(hpsat_sort_ctx *)arg;
+	const size_t n = ctx.leaf.size();
+	const size_t end = ((index + 1) * n) / ctx.nwork;
+
+	/* nested calls would run serially, so do not split again */
+	for (size_t x = (index * n) / ctx.nwork; x != end; x++)
+		hpsat_sort_tree(*ctx.leaf[x]);
+}
+
+static bool
+hpsat_sort_parallel(EQ &eq)
+{
+	const size_t nwork = 4 * hpsat_nthreads();
+	size_t nodes = 1;
+
+	if (nwork <= 4)
+		return (false);
+
+	for (EQ *peq = eq.first(); peq; peq = peq->next())
+		nodes += peq->nodes;
+
+	if (nodes < HPSAT_SORT_PARALLEL)
+		return (false);
+
+	std::vector<EQ *> split;
+	hpsat_sort_ctx ctx;
+
+	split.push_back(&eq);
+
+	for (size_t x = 0; x != split.size(); x++) {
+		for (EQ *peq = split[x]->first(); peq; peq = peq->next()) {
+			if (peq->first() != 0 && split.size() < nwork &&
+			    peq->nodes >= nodes / nwork)
+				split.push_back(peq);
+			else
+				ctx.leaf.push_back(peq);
+		}
+	}
+
+	ctx.nwork = (ctx.leaf.size() < nwork) ? ctx.leaf.size() : nwork;
+
+	hpsat_parallel(ctx.nwork, &hpsat_sort_work, &ctx);
+
+	/* children are split after their parents */
+	for (size_t x = split.size(); x-- != 0; )
+		hpsat_sort_node(*split[x]);
+
+	return (true);
+}
+
+EQ &
+EQ :: sort()
+{
+#if defined(DEBUG) && defined(VERIFY)
+	EQ copy(*this);
+#endif
+	if (!hpsat_sort_parallel(*this))
+		hpsat_sort_tree(*this);
 
 #if defined(DEBUG) && defined(VERIFY)
 	if (hpsat_verify(copy, EQ(), *this, 0) == false) {
@@ -380,12 +844,6 @@ done:
 	}
 #endif
 	return (*this);
-
-select:
-	peq->remove(&head);
-	*this = *peq;
-	delete peq;
-	goto done;
 }
 
 EQ &
@@ -412,53 +870,128 @@ EQ :: optimise()
 EQ &
 EQ :: expand(hpsat_var_t _var, bool _value)
 {
+	hpsat_stack<hpsat_walk> stack;
+
 	if (var == _var) {
 		var = _value ? HPSAT_VAR_ONE : HPSAT_VAR_ZERO;
-	} else {
-		for (EQ *peq = first(); peq; peq = peq->next())
-			peq->expand(_var, _value);
+		update();
+		return (*this);
+	} else if (_var > vmax) {
+		return (*this);
+	}
+
+	stack.push({ this, first() });
+
+	while (!stack.empty()) {
+		hpsat_walk &f = stack.top();
+		EQ *pc = f.pnext;
+
+		if (pc == 0) {
+			f.pe->update();
+			stack.pop();
+			continue;
+		}
+		f.pnext = pc->next();
+
+		if (pc->var == _var) {
+			pc->var = _value ? HPSAT_VAR_ONE : HPSAT_VAR_ZERO;
+			pc->update();
+		} else if (_var <= pc->vmax && pc->first() != 0) {
+			stack.push({ pc, pc->first() });
+		}
 	}
 	return (*this);
 }
 
-bool
-EQ :: expand_all(const uint8_t *pval) const
+struct hpsat_eval_frame {
+	const EQ *pe;
+	const EQ *pnext;
+	bool acc;
+};
+
+static inline bool
+hpsat_eval_leaf(const EQ &eq, const uint8_t *pval)
 {
-	bool temp;
+	switch (eq.var) {
+	case HPSAT_VAR_ZERO:
+	case HPSAT_VAR_ORED:
+	case HPSAT_VAR_XORED:
+		return (false);
+	case HPSAT_VAR_ONE:
+	case HPSAT_VAR_ANDED:
+		return (true);
+	default:
+		return (pval[eq.var] != 0);
+	}
+}
 
-	switch (var) {
+/* accumulate a child value, returns true when the group is decided */
+static inline bool
+hpsat_eval_acc(hpsat_eval_frame &f, bool value)
+{
+	switch (f.pe->var) {
 	case HPSAT_VAR_XORED:
-		temp = false;
-		for (EQ *peq = first(); peq; peq = peq->next())
-			temp ^= peq->expand_all(pval);
-		break;
+		f.acc ^= value;
+		return (false);
 	case HPSAT_VAR_ORED:
-		temp = false;
-		for (EQ *peq = first(); peq; peq = peq->next())
-			temp |= peq->expand_all(pval);
-		break;
-	case HPSAT_VAR_ANDED:
-		temp = true;
-		for (EQ *peq = first(); peq; peq = peq->next())
-			temp &= peq->expand_all(pval);
-		break;
-	case HPSAT_VAR_ZERO:
-		temp = false;
-		break;
-	case HPSAT_VAR_ONE:
-		temp = true;
-		break;
+		if (!value)
+			return (false);
+		f.acc = true;
+		return (true);
 	default:
-		temp = (pval[var] != 0);
-		break;
+		if (value)
+			return (false);
+		f.acc = false;
+		return (true);
+	}
+}
+
+bool
+EQ :: expand_all(const uint8_t *pval) const
+{
+	/* empty groups evaluate to their identity */
+	if (first() == 0)
+		return (hpsat_eval_leaf(*this, pval));
+
+	hpsat_stack<hpsat_eval_frame> stack;
+	bool value;
+
+	stack.push({ this, first(), var == HPSAT_VAR_ANDED });
+
+	while (1) {
+		hpsat_eval_frame &f = stack.top();
+		const EQ *pc = f.pnext;
+
+		if (pc != 0) {
+			f.pnext = pc->next();
+			if (pc->first() != 0) {
+				stack.push({ pc, pc->first(),
+				    pc->var == HPSAT_VAR_ANDED });
+				continue;
+			}
+			if (hpsat_eval_acc(f, hpsat_eval_leaf(*pc, pval)))
+				f.pnext = 0;
+			continue;
+		}
+
+		/* the group is done, pass its value to the parent */
+		value = f.acc;
+		stack.pop();
+		if (stack.empty())
+			return (value);
+		if (hpsat_eval_acc(stack.top(), value))
+			stack.top().pnext = 0;
 	}
-	return (temp);
 }
 
 void
 EQ :: print(std::ostream &out) const
 {
-	switch (var) {
+	hpsat_stack<hpsat_walk> stack;
+	const EQ *pe = this;
+
+descend:
+	switch (pe->var) {
 	case HPSAT_VAR_ZERO:
 		out << "0";
 		break;
@@ -466,92 +999,337 @@ EQ :: print(std::ostream &out) const
 		out << "1";
 		break;
 	case HPSAT_VAR_ORED:
-		out << "(";
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			peq->print();
-			if (peq->next())
-				out << "|";
-		}
-		out << ")";
-		break;
 	case HPSAT_VAR_XORED:
-		out << "(";
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			peq->print();
-			if (peq->next())
-				out << "^";
-		}
-		out << ")";
-		break;
 	case HPSAT_VAR_ANDED:
 		out << "(";
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			peq->print();
-			if (peq->next())
-				out << "&";
-		}
-		out << ")";
+		stack.push({ (EQ *)(uintptr_t)pe, pe->first() });
 		break;
 	default:
 		out << "v[";
-		out << var;
+		out << pe->var;
 		out << "]";
 		break;
 	}
+
+	while (!stack.empty()) {
+		hpsat_walk &f = stack.top();
+
+		if (f.pnext == 0) {
+			out << ")";
+			stack.pop();
+			continue;
+		}
+		pe = f.pnext;
+		if (pe != f.pe->first()) {
+			switch (f.pe->var) {
+			case HPSAT_VAR_ORED:
+				out << "|";
+				break;
+			case HPSAT_VAR_XORED:
+				out << "^";
+				break;
+			default:
+				out << "&";
+				break;
+			}
+		}
+		f.pnext = pe->next();
+		goto descend;
+	}
+}
+
+struct hpsat_compare_frame {
+	const EQ *pa;
+	const EQ *pb;
+};
+
+static inline int
+hpsat_compare_node(const EQ &a, const EQ &b)
+{
+	if (a.var > b.var)
+		return (1);
+	else if (a.var < b.var)
+		return (-1);
+	else if (a.hash > b.hash)
+		return (1);
+	else if (a.hash < b.hash)
+		return (-1);
+	else
+		return (0);
 }
 
 int
 EQ :: compare(const EQ & other) const
 {
-	EQ *pa;
-	EQ *pb;
+	int cmp = hpsat_compare_node(*this, other);
 
-	if (var > other.var)
-		return (1);
-	else if (var < other.var)
-		return (-1);
+	if (cmp != 0 || (first() == 0 && other.first() == 0))
+		return (cmp);
 
-	pa = first();
-	pb = other.first();
+	/* compare the children in order */
+	hpsat_stack<hpsat_compare_frame> stack;
 
-	while (pa && pb) {
-		int cmp = pa->compare(*pb);
+	stack.push({ first(), other.first() });
+
+	while (1) {
+		hpsat_compare_frame &f = stack.top();
+		const EQ *pa = f.pa;
+		const EQ *pb = f.pb;
+
+		if (pa == 0 || pb == 0) {
+			if (pa != pb)
+				return ((pa != 0) - (pb != 0));
+			stack.pop();
+			if (stack.empty())
+				return (0);
+			continue;
+		}
+		f.pa = pa->next();
+		f.pb = pb->next();
+
+		cmp = hpsat_compare_node(*pa, *pb);
 		if (cmp != 0)
 			return (cmp);
-		pa = pa->next();
-		pb = pb->next();
+		if (pa->first() != 0 || pb->first() != 0)
+			stack.push({ pa->first(), pb->first() });
+	}
+}
+
+/* bit-packed truth tables */
+
+struct hpsat_table_ctx {
+	const EQC *pcode;
+	const hpsat_var_t *pvars;
+	size_t nvars;
+	hpsat_var_t vMax;
+	uint64_t *pout;
+	uint64_t first;
+	uint64_t num;
+	uint64_t mask;
+};
+
+#define	HPSAT_TABLE_PIECE 4096	/* words */
+
+static void
+hpsat_table_work(size_t index, void *arg)
+{
+	hpsat_table_ctx &ctx = *(hpsat_table_ctx *)arg;
+	const size_t nword = EQC::words();
+	uint64_t x = index * HPSAT_TABLE_PIECE;
+	uint64_t end = x + HPSAT_TABLE_PIECE;
+	uint64_t *pw = new uint64_t [ctx.vMax * (nword + 1)];
+	uint64_t *pw1 = pw + ctx.vMax * nword;
+
+	if (end > ctx.num)
+		end = ctx.num;
+
+	memset(pw, 0, sizeof(pw[0]) * ctx.vMax * (nword + 1));
+
+	while (x != end) {
+		const uint64_t word = ctx.first + x;
+
+		/* use wide lanes when aligned, else one word at a time */
+		if ((word % nword) == 0 && end - x >= nword) {
+			hpsat_slice(pw, nword, ctx.pvars, ctx.nvars,
+			    word / nword);
+			ctx.pcode->eval(pw, ctx.pout + x, nword);
+			x += nword;
+		} else {
+			hpsat_slice(pw1, 1, ctx.pvars, ctx.nvars, word);
+			ctx.pout[x] = ctx.pcode->eval(pw1);
+			x += 1;
+		}
 	}
-	return ((pa != 0) - (pb != 0));
+
+	/* mask off duplicate entries when there are less than 64 */
+	if (index == 0)
+		ctx.pout[0] &= ctx.mask;
+
+	delete [] pw;
+}
+
+static hpsat_var_t
+hpsat_table_vars(const uint8_t *pval, hpsat_var_t vMax, hpsat_var_t *pvars)
+{
+	hpsat_var_t log2 = 0;
+
+	for (hpsat_var_t x = HPSAT_VAR_MIN; x < vMax; x++) {
+		if (pval[x] != 0)
+			pvars[log2++] = x;
+	}
+	return (log2);
+}
+
+/*
+ * Compute "num" words of the bit-packed table, starting at word "first".
+ * Table entry "x" is stored in bit "x % 64" of word "x / 64".
+ */
+static void
+hpsat_table_fill(const EQC &code, const hpsat_var_t *pvars, size_t nvars,
+    hpsat_var_t vMax, uint64_t *pout, uint64_t first, uint64_t num)
+{
+	hpsat_table_ctx ctx;
+
+	ctx.pcode = &code;
+	ctx.pvars = pvars;
+	ctx.nvars = nvars;
+	ctx.vMax = vMax;
+	ctx.pout = pout;
+	ctx.first = first;
+	ctx.num = num;
+	ctx.mask = (nvars < 6 && first == 0) ?
+	    ((1ULL << (1U << nvars)) - 1ULL) : -1ULL;
+
+	hpsat_parallel((num + HPSAT_TABLE_PIECE - 1) / HPSAT_TABLE_PIECE,
+	    &hpsat_table_work, &ctx);
+}
+
+static uint64_t
+hpsat_table_words(hpsat_var_t log2)
+{
+	return ((log2 < 6) ? 1 : (1ULL << (log2 - 6)));
+}
+
+uint64_t *
+EQ :: toBits(const uint8_t *pval, hpsat_var_t vMax) const
+{
+	hpsat_var_t *pvars = new hpsat_var_t [vMax];
+	const hpsat_var_t log2 = hpsat_table_vars(pval, vMax, pvars);
+	uint64_t *ptable = 0;
+
+	if (log2 <= 32) {
+		const EQC code(*this);
+		const uint64_t nwords = hpsat_table_words(log2);
+
+		ptable = new uint64_t [nwords];
+		hpsat_table_fill(code, pvars, log2, vMax, ptable, 0, nwords);
+	}
+	delete [] pvars;
+	return (ptable);
+}
+
+/*
+ * Stream the bit-packed table to a callback, "chunk" words at a
+ * time, so that the full table never needs to fit in memory. The
+ * callback returns true to stop. Returns false if stopped.
+ */
+bool
+EQ :: toTable(const uint8_t *pval, hpsat_var_t vMax, eq_table_cb_t *cb,
+    void *arg, size_t chunk) const
+{
+	hpsat_var_t *pvars = new hpsat_var_t [vMax];
+	const hpsat_var_t log2 = hpsat_table_vars(pval, vMax, pvars);
+	bool retval = true;
+
+	if (log2 < 64 && chunk != 0) {
+		const EQC code(*this);
+		const uint64_t nwords = hpsat_table_words(log2);
+		uint64_t *pbuf = new uint64_t [chunk];
+
+		for (uint64_t x = 0; x < nwords; x += chunk) {
+			const uint64_t num = (nwords - x < chunk) ?
+			    (nwords - x) : chunk;
+
+			hpsat_table_fill(code, pvars, log2, vMax, pbuf, x, num);
+			if (cb(pbuf, x, num, arg)) {
+				retval = false;
+				break;
+			}
+		}
+		delete [] pbuf;
+	} else {
+		retval = false;
+	}
+	delete [] pvars;
+	return (retval);
+}
+
+/*
+ * Write the bit-packed table into a memory mapped file. Returns zero
+ * on success, EINVAL if there are too many variables, and else the
+ * error number from sizing, mapping or syncing the file.
+ */
+int
+EQ :: toTable(const uint8_t *pval, hpsat_var_t vMax, int fd) const
+{
+	hpsat_var_t *pvars = new hpsat_var_t [vMax];
+	const hpsat_var_t log2 = hpsat_table_vars(pval, vMax, pvars);
+	const uint64_t nwords = hpsat_table_words(log2);
+	const size_t size = nwords * sizeof(uint64_t);
+	void *ptr;
+	int error;
+
+	if (log2 > 48) {
+		delete [] pvars;
+		return (EINVAL);
+	}
+
+	/* reserve the blocks, so that a full disk is reported here */
+	if (ftruncate(fd, size) != 0)
+		error = errno;
+	else
+		error = posix_fallocate(fd, 0, size);
+	if (error != 0) {
+		delete [] pvars;
+		return (error);
+	}
+
+	ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		error = errno;
+		delete [] pvars;
+		return (error);
+	}
+
+	const EQC code(*this);
+
+	hpsat_table_fill(code, pvars, log2, vMax, (uint64_t *)ptr, 0, nwords);
+
+	/* write errors show up when syncing */
+	if (msync(ptr, size, MS_SYNC) != 0)
+		error = errno;
+
+	munmap(ptr, size);
+	delete [] pvars;
+	return (error);
 }
 
 bool *
 EQ :: toTable(uint8_t *pval, hpsat_var_t vMax) const
 {
-	uint8_t *ptemp = new uint8_t [vMax];
+	hpsat_var_t *pvars = new hpsat_var_t [vMax];
 	hpsat_var_t log2 = 0;
 	bool *ptable;
 
-	memset(ptemp, 0, sizeof(ptemp[0]) * vMax);
-
-	for (hpsat_var_t x = HPSAT_VAR_MIN; x < vMax; x++)
-		log2 += (pval[x] != 0);
+	for (hpsat_var_t x = HPSAT_VAR_MIN; x < vMax; x++) {
+		if (pval[x] != 0)
+			pvars[log2++] = x;
+	}
 
-	if (log2 > 24)
+	if (log2 > 24) {
+		delete [] pvars;
 		return (0);
+	}
 
 	ptable = new bool [1UL << log2];
 
-	for (hpsat_var_t x = 0; x != (1UL << log2); x++) {
+	const EQC code(*this);
+	uint64_t *pw = new uint64_t [vMax];
 
-		ptable[x] = expand_all(ptemp);
+	memset(pw, 0, sizeof(pw[0]) * vMax);
 
-		for (hpsat_var_t z = HPSAT_VAR_MIN; z < vMax; z++) {
-			if (pval[z] == 0)
-				continue;
-			ptemp[z] ^= true;
-			if (ptemp[z])
-				break;
-		}
+	/* evaluate 64 entries at a time */
+	for (hpsat_var_t x = 0; x < (1UL << log2); x += 64) {
+		hpsat_slice(pw, 1, pvars, log2, x / 64);
+
+		const uint64_t value = code.eval(pw);
+
+		for (hpsat_var_t y = 0; y != 64 && x + y != (1UL << log2); y++)
+			ptable[x + y] = (value >> y) & 1;
 	}
+
+	delete [] pvars;
+	delete [] pw;
+
 	return (ptable);
 }
@@ -30,11 +30,14 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <assert.h>
 
 #include <sys/queue.h>
 
 #include <iostream>
+#include <utility>
+#include <vector>
 
 #define	HPSAT_SWAP(a,b) do {	       	\
 	typeof(a) __tmp = (a);	       	\
@@ -42,6 +45,55 @@
 	(b) = __tmp;		       	\
 } while (0)
 
+/*
+ * Explicit stack for tree traversals, so that deep expressions do not
+ * overflow the call stack. The first entries are kept inline.
+ */
+template <typename T, size_t N = 64>
+class hpsat_stack {
+public:
+	hpsat_stack() {
+		pbase = inl;
+		num = 0;
+		max = N;
+	}
+	hpsat_stack(const hpsat_stack &) = delete;
+	hpsat_stack & operator =(const hpsat_stack &) = delete;
+
+	~hpsat_stack() {
+		if (pbase != inl)
+			delete [] pbase;
+	}
+
+	void push(const T &elem) {
+		if (num == max) {
+			T *pnew = new T [2 * max];
+
+			for (size_t x = 0; x != num; x++)
+				pnew[x] = pbase[x];
+			if (pbase != inl)
+				delete [] pbase;
+			pbase = pnew;
+			max *= 2;
+		}
+		pbase[num++] = elem;
+	}
+	T & top() {
+		return (pbase[num - 1]);
+	}
+	void pop() {
+		num--;
+	}
+	bool empty() const {
+		return (num == 0);
+	}
+private:
+	T inl[N];
+	T *pbase;
+	size_t num;
+	size_t max;
+};
+
 enum {
 	HPSAT_VAR_ZERO = 0,
 	HPSAT_VAR_ONE = 1,
@@ -52,18 +104,44 @@ enum {
 	HPSAT_VAR_MAX = SIZE_MAX / 2, /* exclusive */
 };
 
+enum {
+	HPSAT_UNSAT = 0,
+	HPSAT_SAT = 1,
+	HPSAT_UNKNOWN = 2,
+};
+
+enum {
+	HPSAT_ORDER_INDEX,
+	HPSAT_ORDER_OCCURRENCE,
+	HPSAT_ORDER_DEGREE,
+	HPSAT_ORDER_FILL,
+};
+
+/* terminates an XOR line in the EQ_CNF literals */
+#define	HPSAT_CNF_XOR (-SSIZE_MAX - 1)
+
 typedef size_t hpsat_var_t;
 
 typedef bool (eq_solve_cb_t)(const uint8_t *, void *);
+typedef void (hpsat_work_t)(size_t, void *);
+typedef bool (eq_table_cb_t)(const uint64_t *, uint64_t, size_t, void *);
 
 class EQ;
 typedef TAILQ_CLASS_HEAD(EQ_HEAD, EQ) EQ_HEAD_t;
 typedef TAILQ_CLASS_ENTRY(EQ) EQ_ENTRY_t;
 
-struct EQP {
-	EQ *p;
-	bool s;
-};
+static inline size_t
+hpsat_hash_var(hpsat_var_t var)
+{
+	return (var * 0x9E3779B97F4A7C15ULL);
+}
+
+static inline size_t
+hpsat_hash_mix(size_t hash, size_t other)
+{
+	return (hash ^
+	    (other + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2)));
+}
 
 class EQ {
 public:
@@ -71,39 +149,75 @@ public:
 	EQ_ENTRY_t entry;
 	hpsat_var_t var;
 
-	EQ(const EQ &other) {
+	/* cached metadata, valid after sort() or update() */
+	size_t hash;
+	hpsat_var_t vmax;
+	size_t nodes;
+	bool isxor;
+
+	EQ(const EQ &other);
+
+	/* steals the children */
+	EQ(EQ &&other) noexcept {
 		TAILQ_INIT(&head);
+		TAILQ_CONCAT(&head, &other.head, entry);
 		var = other.var;
-		for (EQ *peq = other.first(); peq; peq = peq->next())
-			peq->dup()->insert_tail(&head);
+		hash = other.hash;
+		vmax = other.vmax;
+		nodes = other.nodes;
+		isxor = other.isxor;
+		other.var = HPSAT_VAR_ZERO;
+		other.update();
 	}
 
 	EQ(hpsat_var_t _var = HPSAT_VAR_ZERO) {
 		TAILQ_INIT(&head);
 		var = _var;
+		update();
 	}
 
 	~EQ() {
 		EQ *peq;
 
-		while ((peq = first()))
-			delete peq->remove(&head);
+		/* move the grandchildren up, so deleting does not recurse */
+		while ((peq = first())) {
+			EQ *pc;
+
+			peq->remove(&head);
+			while ((pc = peq->last())) {
+				pc->remove(&peq->head);
+				if (pc->first() != 0)
+					pc->insert_head(&head);
+				else
+					delete pc;
+			}
+			delete peq;
+		}
 	}
 
+	static void *operator new(size_t);
+	static void operator delete(void *);
+
 	EQ *dup(void) const {
 		return (new EQ(*this));
 	}
 
-	bool contains(hpsat_var_t _var) const {
-		if (var == _var)
-			return (true);
+	void update() {
+		hash = hpsat_hash_var(var);
+		vmax = var;
+		nodes = 1;
+		isxor = (var != HPSAT_VAR_ORED && var != HPSAT_VAR_ANDED);
 
 		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->contains(_var))
-				return (true);
+			hash = hpsat_hash_mix(hash, peq->hash);
+			if (peq->vmax > vmax)
+				vmax = peq->vmax;
+			nodes += peq->nodes;
+			isxor &= peq->isxor;
 		}
-		return (false);
 	}
+
+	bool contains(hpsat_var_t) const;
 	EQ & operator =(const EQ &other) {
 		EQ *peq;
 		EQ *pfq = (EQ *)(uintptr_t)&other;
@@ -111,65 +225,72 @@ public:
 		if (this == &other)
 			return (*this);
 		var = other.var;
+		hash = other.hash;
+		vmax = other.vmax;
+		nodes = other.nodes;
+		isxor = other.isxor;
 
 		while ((peq = first()))
 			delete peq->remove(&head);
 		TAILQ_CONCAT(&head, &pfq->head, entry);
+		pfq->update();
 		return (*this);
 	}
 
-	EQ operator !() const;
+	EQ & operator =(EQ &&other) noexcept {
+		return (*this = (const EQ &)other);
+	}
+
+	EQ operator !() const &;
+	EQ operator !() &&;
 
 	EQ & operator |=(const EQ &);
-	EQ operator |(const EQ &) const;
+	EQ & operator |=(EQ &&);
+	EQ operator |(const EQ &) const &;
+	EQ operator |(EQ &&) const &;
+	EQ operator |(const EQ &) &&;
+	EQ operator |(EQ &&) &&;
 
 	EQ & operator &=(const EQ &);
-	EQ operator &(const EQ &) const;
+	EQ & operator &=(EQ &&);
+	EQ operator &(const EQ &) const &;
+	EQ operator &(EQ &&) const &;
+	EQ operator &(const EQ &) &&;
+	EQ operator &(EQ &&) &&;
 
 	EQ & operator ^=(const EQ &);
-	EQ operator ^(const EQ &) const;
+	EQ & operator ^=(EQ &&);
+	EQ operator ^(const EQ &) const &;
+	EQ operator ^(EQ &&) const &;
+	EQ operator ^(const EQ &) &&;
+	EQ operator ^(EQ &&) &&;
+
+	static EQ build(hpsat_var_t, const EQ *, size_t);
+	static EQ build(hpsat_var_t, const std::vector<EQ> &);
+	static EQ build(hpsat_var_t, std::vector<EQ> &&);
 
 	EQ & expand(hpsat_var_t, bool);
 
 	hpsat_var_t maxVar() const {
-		hpsat_var_t vmax = var;
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			hpsat_var_t v = peq->maxVar();
-			if (v > vmax)
-				vmax = v;
-		}
 		return (vmax);
 	}
 
-	hpsat_var_t usedVar(uint8_t *pval) const {
-		hpsat_var_t retval = (pval[var] == 0);
-
-		pval[var] = 1;
-
-		for (EQ *pe = first(); pe; pe = pe->next())
-			retval += pe->usedVar(pval);
-
-		return (retval);
-	}
+	hpsat_var_t usedVar(uint8_t *pval) const;
 
 	bool *toTable(uint8_t *pval, hpsat_var_t vMax) const;
+	uint64_t *toBits(const uint8_t *pval, hpsat_var_t vMax) const;
+	bool toTable(const uint8_t *pval, hpsat_var_t vMax, eq_table_cb_t *,
+	    void *, size_t chunk = 1UL << 16) const;
+	int toTable(const uint8_t *pval, hpsat_var_t vMax, int fd) const;
 
 	bool isConst() const {
 		return (maxVar() < HPSAT_VAR_MIN);
 	}
 
 	bool isXOR() const {
-		if (var == HPSAT_VAR_ORED || var == HPSAT_VAR_ANDED)
-			return (false);
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == false)
-				return (false);
-		}
-		return (true);
+		return (isxor);
 	}
 
-	bool simplify(EQP *);
-
 	EQ & sort();
 	EQ & optimise();
 
@@ -233,18 +354,307 @@ public:
 		return (compare(other) != 0);
 	}
 
-	bool solve(uint8_t *pvar, hpsat_var_t vmax, eq_solve_cb_t *cb = 0, void *arg = 0);
+	int solve(uint8_t *pvar, hpsat_var_t vmax, eq_solve_cb_t *cb = 0,
+	    void *arg = 0, const hpsat_var_t *porder = 0, size_t budget = 0);
 
 	int from_cnf(std::istream &);
+	int from_cnf(int);
+	int from_aiger(std::istream &);
+	int from_aiger(int);
+};
+
+/* compiled expression, for fast evaluation */
+
+class EQC {
+public:
+	EQC() {
+		pcode = 0;
+		ncode = 0;
+		ndepth = 0;
+	}
+	EQC(const EQ &eq) {
+		pcode = 0;
+		ncode = 0;
+		ndepth = 0;
+		compile(eq);
+	}
+	EQC(const EQC &) = delete;
+	EQC & operator =(const EQC &) = delete;
+
+	~EQC() {
+		delete [] pcode;
+	}
+
+	void swap(EQC &other) {
+		HPSAT_SWAP(pcode, other.pcode);
+		HPSAT_SWAP(ncode, other.ncode);
+		HPSAT_SWAP(ndepth, other.ndepth);
+	}
+
+	EQC & compile(const EQ &);
+	bool eval(const uint8_t *) const;
+	uint64_t eval(const uint64_t *) const;
+	void eval(const uint64_t *, uint64_t *, size_t) const;
+
+	static size_t words(void);
+
+	hpsat_var_t *pcode;
+	size_t ncode;
+	size_t ndepth;
+};
+
+/* slab allocator for EQ nodes */
+
+class EQ_ARENA {
+public:
+	EQ_ARENA();
+	~EQ_ARENA();
+
+	void *alloc();
+	void free(void *);
+	void reset();
+	EQ_ARENA *child(size_t);
+
+private:
+	void *pfree;
+	void *pslab;
+	char *pnext;
+	char *pend;
+	EQ_ARENA *pchild;
+	EQ_ARENA *psibling;
+	EQ_ARENA *pparent;
+	size_t index;
+	bool persistent;
+
+	const EQ_ARENA *root() const {
+		const EQ_ARENA *pa = this;
+
+		while (pa->pparent != 0)
+			pa = pa->pparent;
+		return (pa);
+	}
+
+	friend EQ_ARENA *hpsat_arena_get(void);
+	friend class hpsat_arena_thread;
+};
+
+extern EQ_ARENA *hpsat_arena_get(void);
+extern EQ_ARENA *hpsat_arena_set(EQ_ARENA *);
+
+/* hash-consed expression DAG */
+
+struct EQ_NODE {
+	EQ_NODE *hnext;
+	size_t hash;
+	hpsat_var_t var;
+	size_t num;
+	const EQ_NODE *child[1];
+};
+
+class EQ_DAG {
+public:
+	EQ_DAG();
+	~EQ_DAG();
+
+	const EQ_NODE *node(hpsat_var_t, const EQ_NODE * const *, size_t);
+	const EQ_NODE *node(hpsat_var_t _var) {
+		return (node(_var, 0, 0));
+	}
+	const EQ_NODE *intern(const EQ &);
+	EQ & expand(const EQ_NODE *, EQ &) const;
+
+	static int compare(const EQ_NODE *, const EQ_NODE *);
+
+	size_t size() const {
+		return (count);
+	}
+private:
+	const EQ_NODE *lookup(hpsat_var_t, const EQ_NODE * const *, size_t);
+
+	EQ_NODE **ptable;
+	size_t mask;
+	size_t count;
+};
+
+/*
+ * Compact expression. The children of a group are stored by value in
+ * one contiguous array, so that variables need no allocation of their
+ * own, and variables are limited to 32 bits. Converting an EQ with a
+ * larger variable throws std::range_error.
+ *
+ * A node can not hold children of its own type inline, so every group
+ * has one allocation for all of its children. Groups are never left
+ * with a single child by sort(), and leaves, which are the bulk of the
+ * nodes, are already stored inline in the array of their parent.
+ */
+
+class EQV {
+public:
+	uint32_t var;
+	uint32_t num;		/* number of children */
+	uint32_t vmax;
+	size_t hash;
+	EQV *pchild;
+
+	EQV(uint32_t _var = HPSAT_VAR_ZERO) {
+		var = _var;
+		num = 0;
+		pchild = 0;
+		update();
+	}
+	EQV(const EQV &);
+	EQV(EQV &&other) noexcept {
+		var = other.var;
+		num = other.num;
+		vmax = other.vmax;
+		hash = other.hash;
+		pchild = other.pchild;
+		other.num = 0;
+		other.pchild = 0;
+	}
+	EQV(const EQ &);
+
+	~EQV() {
+		if (pchild != 0)
+			release();
+	}
+
+	EQV & operator =(const EQV &other) {
+		if (this != &other)
+			*this = EQV(other);
+		return (*this);
+	}
+	EQV & operator =(EQV &&other) noexcept {
+		if (this != &other) {
+			EQV old(std::move(*this));
+
+			var = other.var;
+			num = other.num;
+			vmax = other.vmax;
+			hash = other.hash;
+			pchild = other.pchild;
+			other.num = 0;
+			other.pchild = 0;
+		}
+		return (*this);
+	}
+
+	void update();
+
+	const EQV *begin() const {
+		return (pchild);
+	}
+	const EQV *end() const {
+		return (pchild + num);
+	}
+
+	hpsat_var_t maxVar() const {
+		return (vmax);
+	}
+	bool contains(hpsat_var_t) const;
+
+	EQV & sort();
+	EQV & expand(hpsat_var_t, bool);
+	bool expand_all(const uint8_t *pval) const;
+	int compare(const EQV &) const;
+	EQ toEQ(void) const;
+	void print(std::ostream &out = std::cout) const;
+
+	bool operator ==(const EQV &other) const {
+		return (compare(other) == 0);
+	}
+	bool operator !=(const EQV &other) const {
+		return (compare(other) != 0);
+	}
+private:
+	void release();
+};
+
+/* clause database, used to preprocess CNF files */
+
+class EQ_CNF {
+public:
+	EQ_CNF() {
+		nvars = 0;
+	}
+
+	int from_cnf(std::istream &);
+	int from_cnf(int);
+	void add(const ssize_t *, size_t);
+	void add_xor(const ssize_t *, size_t);
+	bool preprocess(void);
+	EQ toEQ(void) const;
+	void extend(uint8_t *) const;
+
+	hpsat_var_t maxVar(void) const {
+		return (nvars + HPSAT_VAR_MIN - 1);
+	}
+	size_t size(void) const;
+private:
+	std::vector<ssize_t> lits;	/* zero terminated clauses and XORs */
+	std::vector<ssize_t> stack;	/* witness first, zero terminated */
+	ssize_t nvars;
+};
+
+/* incremental solver, which keeps the elimination state between calls */
+
+class EQ_SOLVER {
+public:
+	EQ_SOLVER(hpsat_var_t _vmax = HPSAT_VAR_MIN,
+	    const hpsat_var_t *porder = 0);
+	~EQ_SOLVER();
+	EQ_SOLVER(const EQ_SOLVER &) = delete;
+	EQ_SOLVER & operator =(const EQ_SOLVER &) = delete;
+
+	EQ_SOLVER & add(const EQ &);
+	int solve(uint8_t *pvar, eq_solve_cb_t *cb = 0, void *arg = 0);
+	int solve(uint8_t *pvar, const ssize_t *passume, size_t nassume,
+	    std::vector<ssize_t> *pfailed = 0, eq_solve_cb_t *cb = 0,
+	    void *arg = 0);
+
+	hpsat_var_t maxVar(void) const {
+		return (vmax - 1);
+	}
+private:
+	void grow(hpsat_var_t);
+	void insert(EQ *);
+	void propagate(void);
+	size_t assume(const ssize_t *, size_t);
+	void undo(void);
+
+	EQ *pzero;
+	EQ *pone;
+	EQ *ppend;		/* new terms, by position */
+	EQC *pczero;
+	EQC *pcone;
+	uint8_t *pdirty;	/* 1: compile again, 2: saved for undo() */
+	hpsat_var_t *pseq;
+	hpsat_var_t *prank;
+	hpsat_var_t vmax;
+	hpsat_var_t valloc;
+	std::vector<size_t> queue;
+	std::vector<hpsat_var_t> undo_var;	/* changed under assumptions */
+	std::vector<EQ *> undo_eq;		/* their cofactors */
+	bool undo_unsat;
+	bool assuming;
+	bool unsat;
 };
 
 /* simplify function */
 
 extern bool hpsat_simplify(EQ &);
 
+/* elimination order */
+
+extern void hpsat_order(const EQ &, hpsat_var_t vmax, hpsat_var_t *porder,
+    int how);
+
 /* generic functions */
 
 extern void hpsat_free(EQ_HEAD_t *);
-extern bool hpsat_verify(const EQ &a, const EQ &b, const EQ &c, uint8_t function);
+extern size_t hpsat_nthreads(void);
+extern void hpsat_parallel(size_t, hpsat_work_t *, void *);
+extern bool hpsat_verify(const EQ &a, const EQ &b, const EQ &c,
+    uint8_t function, uint8_t *pcex = 0);
 
 #endif					/* _HPSAT_H_ */
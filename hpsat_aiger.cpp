@@ -0,0 +1,472 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <unordered_map>
+
+/*
+ * AIGER reader, for both the ASCII ("aag") and the binary ("aig")
+ * format. Inputs and then latches become variables in the order given,
+ * starting at HPSAT_VAR_MIN. Latches are left free, so only the
+ * combinational logic is checked. The resulting expression is zero
+ * when any output or bad state property is one, and all invariant
+ * constraints are one.
+ *
+ * AND gates are interned in an EQ_DAG, which shares common
+ * sub-circuits. When the DAG is turned into an expression, shared
+ * sub-circuits larger than HPSAT_AIG_SHARE nodes are not copied, but
+ * given a new variable "v", and a term "v ^ f", which must be zero.
+ */
+
+#define	HPSAT_AIG_SHARE 16	/* nodes */
+
+enum {
+	HPSAT_AIG_UNDEF,
+	HPSAT_AIG_INPUT,
+	HPSAT_AIG_GATE,
+	HPSAT_AIG_BUSY,
+};
+
+struct hpsat_aig {
+	const char *ptr;
+	const char *end;
+	size_t maxvar;
+	size_t ninputs;
+	size_t nlatches;
+	size_t ngates;
+	size_t nshared;
+	std::vector<uint8_t> state;	/* per AIGER variable */
+	std::vector<size_t> rhs;	/* two literals per AND gate */
+	std::vector<size_t> target;	/* outputs and bad state properties */
+	std::vector<size_t> constraint;
+	std::vector<const EQ_NODE *> node;
+	EQ_DAG dag;
+};
+
+struct hpsat_aig_info {
+	size_t fanout;
+	size_t nodes;
+	hpsat_var_t cut;
+	EQ *peq;
+};
+
+static void
+hpsat_aig_space(hpsat_aig &a)
+{
+	while (a.ptr != a.end && (*a.ptr == ' ' || *a.ptr == '\t'))
+		a.ptr++;
+}
+
+static bool
+hpsat_aig_eol(hpsat_aig &a)
+{
+	hpsat_aig_space(a);
+	return (a.ptr == a.end || *a.ptr == '\n' || *a.ptr == '\r');
+}
+
+static void
+hpsat_aig_next_line(hpsat_aig &a)
+{
+	const char *ptr = (const char *)memchr(a.ptr, '\n', a.end - a.ptr);
+
+	a.ptr = ptr ? ptr + 1 : a.end;
+}
+
+static bool
+hpsat_aig_value(hpsat_aig &a, size_t &value)
+{
+	hpsat_aig_space(a);
+
+	if (a.ptr == a.end || !isdigit(*a.ptr))
+		return (false);
+
+	value = 0;
+	while (a.ptr != a.end && isdigit(*a.ptr)) {
+		if (value > (SIZE_MAX / 4 - 9) / 10)
+			return (false);
+		value = value * 10 + (*a.ptr - '0');
+		a.ptr++;
+	}
+	return (true);
+}
+
+static bool
+hpsat_aig_literal(hpsat_aig &a, size_t &lit)
+{
+	return (hpsat_aig_value(a, lit) && lit / 2 <= a.maxvar);
+}
+
+/* binary AND gates are stored as two LEB128 coded deltas */
+static bool
+hpsat_aig_delta(hpsat_aig &a, size_t &value)
+{
+	unsigned shift = 0;
+
+	value = 0;
+	while (1) {
+		if (a.ptr == a.end || shift > 8 * sizeof(value) - 7)
+			return (false);
+
+		const uint8_t ch = *a.ptr++;
+
+		value |= (size_t)(ch & 0x7f) << shift;
+		if ((ch & 0x80) == 0)
+			break;
+		shift += 7;
+	}
+	return (true);
+}
+
+static int
+hpsat_aig_parse(hpsat_aig &a)
+{
+	size_t hdr[9] = {};
+	bool binary;
+
+	if (a.end - a.ptr < 3)
+		return (EINVAL);
+	if (memcmp(a.ptr, "aag", 3) == 0)
+		binary = false;
+	else if (memcmp(a.ptr, "aig", 3) == 0)
+		binary = true;
+	else
+		return (EINVAL);
+	a.ptr += 3;
+
+	/* M I L O A, optionally followed by B C J F */
+	for (size_t x = 0; x != 9 && !hpsat_aig_eol(a); x++) {
+		if (!hpsat_aig_value(a, hdr[x]))
+			return (EINVAL);
+	}
+	if (!hpsat_aig_eol(a))
+		return (EINVAL);
+	hpsat_aig_next_line(a);
+
+	a.maxvar = hdr[0];
+	a.ninputs = hdr[1];
+	a.nlatches = hdr[2];
+	a.ngates = hdr[4];
+
+	/* justice and fairness properties are not supported */
+	if (hdr[7] != 0 || hdr[8] != 0)
+		return (EINVAL);
+	if (a.maxvar >= HPSAT_VAR_MAX / 2 ||
+	    a.ninputs + a.nlatches + a.ngates < a.ninputs ||
+	    a.ninputs + a.nlatches + a.ngates > a.maxvar)
+		return (EINVAL);
+	if (binary && a.ninputs + a.nlatches + a.ngates != a.maxvar)
+		return (EINVAL);
+
+	a.state.assign(a.maxvar + 1, HPSAT_AIG_UNDEF);
+	a.rhs.assign(2 * (a.maxvar + 1), 0);
+	a.node.assign(a.maxvar + 1, 0);
+	a.node[0] = a.dag.node(HPSAT_VAR_ZERO);
+
+	/* inputs and latches, which are implicit in the binary format */
+	for (size_t x = 0; x != a.ninputs + a.nlatches; x++) {
+		size_t lit = 2 * (x + 1);
+
+		if (!binary && !hpsat_aig_literal(a, lit))
+			return (EINVAL);
+		if (lit == 0 || (lit & 1) ||
+		    a.state[lit / 2] != HPSAT_AIG_UNDEF)
+			return (EINVAL);
+
+		a.state[lit / 2] = HPSAT_AIG_INPUT;
+		a.node[lit / 2] = a.dag.node(x + HPSAT_VAR_MIN);
+
+		/* the next state and reset value of latches are ignored */
+		if (!binary || x >= a.ninputs)
+			hpsat_aig_next_line(a);
+	}
+
+	for (size_t x = 0; x != hdr[3] + hdr[5] + hdr[6]; x++) {
+		size_t lit;
+
+		if (!hpsat_aig_literal(a, lit))
+			return (EINVAL);
+		if (x < hdr[3] + hdr[5])
+			a.target.push_back(lit);
+		else
+			a.constraint.push_back(lit);
+		hpsat_aig_next_line(a);
+	}
+
+	for (size_t x = 0; x != a.ngates; x++) {
+		size_t lhs = 2 * (a.ninputs + a.nlatches + x + 1);
+		size_t r0;
+		size_t r1;
+
+		if (binary) {
+			if (!hpsat_aig_delta(a, r0) || r0 == 0 || r0 > lhs)
+				return (EINVAL);
+			r0 = lhs - r0;
+			if (!hpsat_aig_delta(a, r1) || r1 > r0)
+				return (EINVAL);
+			r1 = r0 - r1;
+		} else {
+			if (!hpsat_aig_literal(a, lhs) ||
+			    !hpsat_aig_literal(a, r0) ||
+			    !hpsat_aig_literal(a, r1))
+				return (EINVAL);
+			hpsat_aig_next_line(a);
+		}
+		if (lhs == 0 || (lhs & 1) ||
+		    a.state[lhs / 2] != HPSAT_AIG_UNDEF)
+			return (EINVAL);
+
+		a.state[lhs / 2] = HPSAT_AIG_GATE;
+		a.rhs[lhs] = r0;
+		a.rhs[lhs + 1] = r1;
+	}
+	return (0);
+}
+
+static const EQ_NODE *
+hpsat_aig_node(hpsat_aig &a, size_t lit)
+{
+	const EQ_NODE *pn[2] = { a.node[lit / 2], a.dag.node(HPSAT_VAR_ONE) };
+
+	if (lit & 1)
+		return (a.dag.node(HPSAT_VAR_XORED, pn, 2));
+	else
+		return (pn[0]);
+}
+
+/* intern the gate of the given variable and everything below it */
+static int
+hpsat_aig_build(hpsat_aig &a, size_t v)
+{
+	std::vector<size_t> stack;
+
+	stack.push_back(v);
+
+	while (!stack.empty()) {
+		const size_t g = stack.back();
+
+		if (a.node[g] != 0) {
+			stack.pop_back();
+			continue;
+		}
+		if (a.state[g] == HPSAT_AIG_UNDEF)
+			return (EINVAL);
+
+		const size_t r0 = a.rhs[2 * g] / 2;
+		const size_t r1 = a.rhs[2 * g + 1] / 2;
+
+		if (a.node[r0] == 0 || a.node[r1] == 0) {
+			/* cyclic definition */
+			if (a.state[g] == HPSAT_AIG_BUSY)
+				return (EINVAL);
+			a.state[g] = HPSAT_AIG_BUSY;
+			if (a.node[r0] == 0)
+				stack.push_back(r0);
+			if (a.node[r1] == 0)
+				stack.push_back(r1);
+			continue;
+		}
+
+		const EQ_NODE *pn[2] = {
+			hpsat_aig_node(a, a.rhs[2 * g]),
+			hpsat_aig_node(a, a.rhs[2 * g + 1])
+		};
+
+		a.node[g] = a.dag.node(HPSAT_VAR_ANDED, pn, 2);
+		a.state[g] = HPSAT_AIG_GATE;
+		stack.pop_back();
+	}
+	return (0);
+}
+
+/* turn the DAG into expressions, bottom up */
+static void
+hpsat_aig_expand(hpsat_aig &a, const EQ_NODE *root, hpsat_var_t vnext, EQ &all)
+{
+	std::unordered_map<const EQ_NODE *, size_t> index;
+	std::vector<std::pair<const EQ_NODE *, size_t>> stack;
+	std::vector<const EQ_NODE *> order;
+	std::vector<hpsat_aig_info> info;
+
+	index.emplace(root, 0);
+	stack.push_back(std::make_pair(root, 0));
+
+	while (!stack.empty()) {
+		const EQ_NODE *pn = stack.back().first;
+
+		if (stack.back().second != pn->num) {
+			const EQ_NODE *pc = pn->child[stack.back().second++];
+			auto it = index.find(pc);
+
+			if (it == index.end()) {
+				index.emplace(pc, 0);
+				stack.push_back(std::make_pair(pc, 0));
+			} else {
+				info[it->second].fanout++;
+			}
+			continue;
+		}
+		stack.pop_back();
+
+		index[pn] = order.size();
+		order.push_back(pn);
+		info.push_back(hpsat_aig_info{ 1, 1, 0, 0 });
+	}
+
+	for (size_t x = 0; x != order.size(); x++) {
+		const EQ_NODE *pn = order[x];
+		hpsat_aig_info &i = info[x];
+		EQ *peq = new EQ(pn->var);
+
+		for (size_t y = 0; y != pn->num; y++) {
+			hpsat_aig_info &ci = info[index[pn->child[y]]];
+			EQ *pc;
+
+			if (ci.cut != 0) {
+				pc = new EQ(ci.cut);
+				i.nodes += 1;
+			} else {
+				i.nodes += ci.nodes;
+				if (--ci.fanout != 0) {
+					pc = ci.peq->dup();
+				} else {
+					pc = ci.peq;
+					ci.peq = 0;
+				}
+			}
+			pc->insert_tail(&peq->head);
+		}
+		peq->update();
+		i.peq = peq;
+
+		if (pn->num == 0 || i.fanout < 2 || i.nodes <= HPSAT_AIG_SHARE)
+			continue;
+
+		EQ *pt = new EQ(HPSAT_VAR_XORED);
+
+		i.cut = vnext++;
+		(new EQ(i.cut))->insert_tail(&pt->head);
+		peq->insert_tail(&pt->head);
+		pt->update();
+		pt->insert_tail(&all.head);
+		i.peq = 0;
+		a.nshared++;
+	}
+
+	hpsat_aig_info &ri = info[index[root]];
+
+	if (ri.cut != 0)
+		(new EQ(ri.cut))->insert_tail(&all.head);
+	else
+		ri.peq->insert_tail(&all.head);
+}
+
+static int
+hpsat_aig_load(EQ &eq, const char *ptr, const char *end)
+{
+	std::vector<const EQ_NODE *> pn;
+	const EQ_NODE *root;
+	hpsat_aig a;
+	EQ *peq;
+
+	a.ptr = ptr;
+	a.end = end;
+	a.nshared = 0;
+
+	if (hpsat_aig_parse(a) != 0)
+		return (EINVAL);
+
+	fprintf(stderr, "c Inputs = %zu\n", a.ninputs);
+	fprintf(stderr, "c Latches = %zu\n", a.nlatches);
+	fprintf(stderr, "c Gates = %zu\n", a.ngates);
+
+	/* any target, under all constraints */
+	for (size_t lit : a.target) {
+		if (hpsat_aig_build(a, lit / 2) != 0)
+			return (EINVAL);
+		pn.push_back(hpsat_aig_node(a, lit));
+	}
+	root = a.dag.node(HPSAT_VAR_ORED, pn.data(), pn.size());
+
+	pn.clear();
+	for (size_t lit : a.constraint) {
+		if (hpsat_aig_build(a, lit / 2) != 0)
+			return (EINVAL);
+		pn.push_back(hpsat_aig_node(a, lit));
+	}
+	pn.push_back(root);
+	root = a.dag.node(HPSAT_VAR_ANDED, pn.data(), pn.size());
+
+	/* solutions are zeros */
+	pn.assign(1, root);
+	pn.push_back(a.dag.node(HPSAT_VAR_ONE));
+	root = a.dag.node(HPSAT_VAR_XORED, pn.data(), pn.size());
+
+	EQ all(HPSAT_VAR_ORED);
+
+	hpsat_aig_expand(a, root, a.ninputs + a.nlatches + HPSAT_VAR_MIN, all);
+
+	fprintf(stderr, "c Shared = %zu\n", a.nshared);
+
+	peq = new EQ();
+	*peq = eq;
+	peq->insert_tail(&all.head);
+
+	eq = all.sort();
+	return (0);
+}
+
+int
+EQ :: from_aiger(std::istream &in)
+{
+	const std::string buf((std::istreambuf_iterator<char>(in)),
+	    std::istreambuf_iterator<char>());
+
+	return (hpsat_aig_load(*this, buf.data(), buf.data() + buf.size()));
+}
+
+int
+EQ :: from_aiger(int fd)
+{
+	struct stat st;
+	const char *base;
+	int error;
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+		return (EINVAL);
+
+	base = (const char *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		return (EINVAL);
+
+	error = hpsat_aig_load(*this, base, base + st.st_size);
+
+	munmap((void *)base, st.st_size);
+	return (error);
+}
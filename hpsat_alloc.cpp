@@ -0,0 +1,237 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+#include <stdlib.h>
+
+#include <mutex>
+
+/*
+ * EQ nodes are carved out of large slabs. Each thread has a default
+ * arena which is never released, so that nodes can be freely passed
+ * between threads. Short lived work, like EQ::solve(), can install
+ * its own arena and release all nodes at once by calling reset().
+ * Nodes are always returned to the current arena of the thread
+ * freeing them, so nodes from an arena must not be freed after the
+ * arena has been uninstalled. Slabs are aligned to their size and
+ * record the arena owning them, so that debug builds can catch this.
+ */
+
+#define	HPSAT_SLAB_SIZE	(1UL << 16)
+
+union hpsat_slot {
+	union hpsat_slot *next;
+	char data[sizeof(EQ)];
+};
+
+/* the header uses the first slot of each slab */
+struct hpsat_slab {
+	struct hpsat_slab *next;
+	EQ_ARENA *owner;
+};
+
+static_assert(sizeof(hpsat_slab) <= sizeof(hpsat_slot), "slab header too big");
+
+static inline hpsat_slab *
+hpsat_slab_of(void *ptr)
+{
+	const uintptr_t mask = HPSAT_SLAB_SIZE - 1;
+
+	return ((hpsat_slab *)((uintptr_t)ptr & ~mask));
+}
+
+static std::mutex hpsat_arena_mtx;
+static EQ_ARENA *hpsat_arena_idle;
+
+static thread_local EQ_ARENA *hpsat_arena_cur;
+static thread_local EQ_ARENA *hpsat_arena_def;
+
+class hpsat_arena_thread {
+public:
+	~hpsat_arena_thread() {
+		/* give the default arena to the next thread */
+		if (hpsat_arena_def != 0) {
+			std::lock_guard<std::mutex> guard(hpsat_arena_mtx);
+			hpsat_arena_def->psibling = hpsat_arena_idle;
+			hpsat_arena_idle = hpsat_arena_def;
+			hpsat_arena_def = 0;
+		}
+	}
+};
+
+static thread_local hpsat_arena_thread hpsat_arena_exit;
+
+EQ_ARENA :: EQ_ARENA()
+{
+	pfree = 0;
+	pslab = 0;
+	pnext = 0;
+	pend = 0;
+	pchild = 0;
+	psibling = 0;
+	pparent = 0;
+	index = 0;
+	persistent = false;
+}
+
+EQ_ARENA :: ~EQ_ARENA()
+{
+	reset();
+}
+
+void *
+EQ_ARENA :: alloc()
+{
+	hpsat_slot *ps = (hpsat_slot *)pfree;
+
+	if (ps != 0) {
+		pfree = ps->next;
+		return (ps);
+	}
+
+	if (pnext == pend) {
+		void *pv;
+
+		if (posix_memalign(&pv, HPSAT_SLAB_SIZE, HPSAT_SLAB_SIZE) != 0)
+			throw std::bad_alloc();
+
+		hpsat_slab *pn = (hpsat_slab *)pv;
+
+		pn->next = (hpsat_slab *)pslab;
+		pn->owner = this;
+		pslab = pn;
+		pnext = (char *)pv + sizeof(*ps);
+		pend = (char *)pv +
+		    (HPSAT_SLAB_SIZE / sizeof(*ps)) * sizeof(*ps);
+	}
+	ps = (hpsat_slot *)pnext;
+	pnext += sizeof(*ps);
+	return (ps);
+}
+
+void
+EQ_ARENA :: free(void *ptr)
+{
+	hpsat_slot *ps = (hpsat_slot *)ptr;
+
+#ifdef DEBUG
+	/*
+	 * The slot is reused by this arena, so its slab must live at
+	 * least as long. That holds for slabs of the default arenas,
+	 * which are never released, and within a family of arenas,
+	 * which are released together.
+	 */
+	assert(hpsat_slab_of(ptr)->owner->persistent ||
+	    hpsat_slab_of(ptr)->owner->root() == root());
+#endif
+
+	ps->next = (hpsat_slot *)pfree;
+	pfree = ps;
+}
+
+void
+EQ_ARENA :: reset()
+{
+	hpsat_slab *ps;
+	EQ_ARENA *pa;
+
+	while ((pa = pchild) != 0) {
+		pchild = pa->psibling;
+		delete pa;
+	}
+
+	while ((ps = (hpsat_slab *)pslab) != 0) {
+		pslab = ps->next;
+		::free(ps);
+	}
+	pfree = 0;
+	pnext = 0;
+	pend = 0;
+}
+
+/* get the child arena with the given index, creating it on first use */
+EQ_ARENA *
+EQ_ARENA :: child(size_t num)
+{
+	std::lock_guard<std::mutex> guard(hpsat_arena_mtx);
+	EQ_ARENA *pa;
+
+	for (pa = pchild; pa != 0; pa = pa->psibling) {
+		if (pa->index == num)
+			return (pa);
+	}
+
+	pa = new EQ_ARENA();
+	pa->pparent = this;
+	pa->index = num;
+	pa->psibling = pchild;
+	pchild = pa;
+	return (pa);
+}
+
+EQ_ARENA *
+hpsat_arena_get(void)
+{
+	if (hpsat_arena_cur != 0)
+		return (hpsat_arena_cur);
+	if (hpsat_arena_def == 0) {
+		std::lock_guard<std::mutex> guard(hpsat_arena_mtx);
+		if (hpsat_arena_idle != 0) {
+			hpsat_arena_def = hpsat_arena_idle;
+			hpsat_arena_idle = hpsat_arena_def->psibling;
+			hpsat_arena_def->psibling = 0;
+		} else {
+			hpsat_arena_def = new EQ_ARENA();
+			hpsat_arena_def->persistent = true;
+		}
+		/* make sure the arena is handed back on thread exit */
+		(void)&hpsat_arena_exit;
+	}
+	return (hpsat_arena_def);
+}
+
+EQ_ARENA *
+hpsat_arena_set(EQ_ARENA *pa)
+{
+	EQ_ARENA *old = hpsat_arena_cur;
+
+	hpsat_arena_cur = pa;
+	return (old);
+}
+
+void *
+EQ :: operator new(size_t size)
+{
+	assert(size == sizeof(EQ));
+	return (hpsat_arena_get()->alloc());
+}
+
+void
+EQ :: operator delete(void *ptr)
+{
+	if (ptr != 0)
+		hpsat_arena_get()->free(ptr);
+}
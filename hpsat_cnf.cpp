@@ -25,6 +25,64 @@
 
 #include "hpsat.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+static EQ
+hpsat_literal(ssize_t temp)
+{
+	if (temp < 0)
+		return (EQ((hpsat_var_t)(-temp + HPSAT_VAR_MIN - 1)));
+	else
+		return (!EQ((hpsat_var_t)(temp + HPSAT_VAR_MIN - 1)));
+}
+
+/*
+ * A clause is satisfied when any of its literals is true. The term is
+ * the AND of the negated literals, built in a single pass.
+ */
+static EQ
+hpsat_clause_literals(const ssize_t *plit, size_t num)
+{
+	std::vector<EQ> temp;
+
+	temp.reserve(num);
+	for (size_t x = 0; x != num; x++)
+		temp.push_back(hpsat_literal(plit[x]));
+	return (EQ::build(HPSAT_VAR_ANDED, std::move(temp)));
+}
+
+/*
+ * An XOR line, "x1 -2 3 0", is satisfied when an odd number of its
+ * literals is true. The term is true when it is violated.
+ */
+static EQ
+hpsat_xor_literals(const ssize_t *plit, size_t num)
+{
+	EQ var(HPSAT_VAR_XORED);
+	bool one = true;
+	EQ *peq;
+
+	for (size_t x = 0; x != num; x++) {
+		ssize_t temp = plit[x];
+
+		if (temp < 0) {
+			temp = -temp;
+			one = !one;
+		}
+		peq = new EQ((hpsat_var_t)(temp + HPSAT_VAR_MIN - 1));
+		peq->insert_tail(&var.head);
+	}
+	if (one) {
+		peq = new EQ(HPSAT_VAR_ONE);
+		peq->insert_tail(&var.head);
+	}
+	var.sort();
+	return (var);
+}
+
 static ssize_t
 hpsat_read_value(std::string &line, size_t &offset)
 {
@@ -53,13 +111,22 @@ hpsat_skip_space(std::string &line, size_t &offset)
 		offset++;
 }
 
-int
-EQ :: from_cnf(std::istream &in)
+/*
+ * The CNF readers either build an EQ term for every clause, or, if
+ * "plits" is set, store the literals of every clause followed by a
+ * zero, or HPSAT_CNF_XOR for XOR lines, for EQ_CNF.
+ */
+static int
+hpsat_cnf_stream(std::istream &in, EQ_HEAD_t *phead,
+    std::vector<ssize_t> *plits, ssize_t &v_max)
 {
+	std::vector<ssize_t> clits;
 	std::string line;
 	ssize_t nexpr = 0;
-	ssize_t v_max = 0;
 	size_t offset;
+	EQ *peq;
+
+	v_max = 0;
 
 	while (getline(in, line)) {
 		if (line[0] == 'c') {
@@ -91,7 +158,11 @@ EQ :: from_cnf(std::istream &in)
 
 	for (size_t x = 0; x != (size_t)nexpr; x++) {
 		ssize_t temp;
-		EQ var(HPSAT_VAR_ONE);
+		size_t nlits = 0;
+		bool isxor = false;
+		EQ var;
+
+		clits.clear();
 next_line:
 		if (!getline(in, line))
 			goto error;
@@ -107,6 +178,11 @@ next_line:
 				temp = hpsat_read_value(line, offset);
 				if (temp == 0)
 					break;
+			} else if (line[offset] == 'x' && nlits == 0 &&
+			    !isxor) {
+				isxor = true;
+				offset++;
+				continue;
 			} else {
 				goto next_line;
 			}
@@ -114,21 +190,444 @@ next_line:
 			if (temp < -v_max || temp > v_max)
 				goto error;
 
+			nlits++;
+
 			/* append expression as AND */
-			if (temp < 0)
-				var &= EQ((hpsat_var_t)(-temp + HPSAT_VAR_MIN - 1));
+			if (plits != 0)
+				plits->push_back(temp);
 			else
-				var &= !EQ((hpsat_var_t)(temp + HPSAT_VAR_MIN - 1));
+				clits.push_back(temp);
 		}
 
-		if (var == EQ(HPSAT_VAR_ONE))
+		if (nlits == 0)
 			goto error;
 
-		/* TODO: Optimise this OR */
+		if (plits != 0) {
+			plits->push_back(isxor ? HPSAT_CNF_XOR : 0);
+			continue;
+		}
+
+		if (isxor)
+			var = hpsat_xor_literals(clits.data(), clits.size());
+		else
+			var = hpsat_clause_literals(clits.data(), clits.size());
+
+		/* collect all clauses and sort them once */
+		peq = new EQ();
+		*peq = var;
+		peq->insert_tail(phead);
+	}
+	return (0);
+error:
+	return (EINVAL);
+}
+
+int
+EQ :: from_cnf(std::istream &in)
+{
+	EQ all(HPSAT_VAR_ORED);
+	ssize_t v_max;
+	EQ *peq;
+
+	if (hpsat_cnf_stream(in, &all.head, 0, v_max) != 0)
+		return (EINVAL);
+
+	peq = new EQ();
+	*peq = *this;
+	peq->insert_tail(&all.head);
+
+	*this = all.sort();
+	return (0);
+}
+
+/* zero-copy parser for memory mapped CNF files */
+
+struct hpsat_cnf_chunk {
+	const char *ptr;
+	const char *end;
+	ssize_t v_max;
+	EQ_HEAD_t head;
+	std::vector<ssize_t> *plits;
+	size_t num;
+	int error;
+};
+
+static ssize_t
+hpsat_read_value(const char *&ptr, const char *end)
+{
+	bool sign = 0;
+	ssize_t value = 0;
+
+	if (ptr != end && *ptr == '-') {
+		sign = 1;
+		ptr++;
+	}
+	while (ptr != end && isdigit(*ptr)) {
+		value *= 10;
+		value += *ptr - '0';
+		ptr++;
+	}
+	return (sign ? -value : value);
+}
+
+static void
+hpsat_skip_space(const char *&ptr, const char *end)
+{
+	while (ptr != end && (*ptr == ' ' || *ptr == '\t'))
+		ptr++;
+}
+
+static const char *
+hpsat_next_line(const char *ptr, const char *end)
+{
+	ptr = (const char *)memchr(ptr, '\n', end - ptr);
+	return (ptr ? ptr + 1 : end);
+}
+
+/*
+ * Find the end of the first clause which starts after the given
+ * position. Literals are never zero, so a zero token outside of a
+ * comment line always terminates a clause.
+ */
+static const char *
+hpsat_clause_boundary(const char *ptr, const char *end)
+{
+	bool start = true;
+
+	ptr = hpsat_next_line(ptr, end);
+
+	while (ptr != end) {
+		if (start && *ptr == 'c') {
+			ptr = hpsat_next_line(ptr, end);
+			continue;
+		}
+		start = false;
+
+		switch (*ptr) {
+		case ' ':
+		case '\t':
+		case '\r':
+			ptr++;
+			break;
+		case '\n':
+			ptr++;
+			start = true;
+			break;
+		case '-':
+		case '0' ... '9':
+			if (hpsat_read_value(ptr, end) == 0)
+				return (ptr);
+			break;
+		case 'x':
+			ptr++;
+			break;
+		default:
+			ptr = hpsat_next_line(ptr, end);
+			start = true;
+			break;
+		}
+	}
+	return (end);
+}
+
+static void
+hpsat_cnf_parse(size_t index, void *arg)
+{
+	hpsat_cnf_chunk &c = ((hpsat_cnf_chunk *)arg)[index];
+	const char *ptr = c.ptr;
+	const char *end = c.end;
+	bool start = (index == 0);
+	bool isxor = false;
+	size_t nlits = 0;
+	std::vector<ssize_t> clits;
+	EQ var;
+	ssize_t temp;
+	EQ *peq;
+
+	while (ptr != end) {
+		if (start && *ptr == 'c') {
+			ptr = hpsat_next_line(ptr, end);
+			continue;
+		}
+		start = false;
+
+		switch (*ptr) {
+		case ' ':
+		case '\t':
+		case '\r':
+			ptr++;
+			break;
+		case '\n':
+			ptr++;
+			start = true;
+			break;
+		case '-':
+		case '0' ... '9':
+			temp = hpsat_read_value(ptr, end);
+			if (temp == 0) {
+				if (nlits == 0) {
+					c.error = EINVAL;
+					return;
+				}
+				if (c.plits != 0) {
+					c.plits->push_back(isxor ?
+					    HPSAT_CNF_XOR : 0);
+				} else {
+					const ssize_t *pl = clits.data();
+					const size_t n = clits.size();
 
-		*this |= var;
+					var = isxor ?
+					    hpsat_xor_literals(pl, n) :
+					    hpsat_clause_literals(pl, n);
+					peq = new EQ();
+					*peq = var;
+					peq->insert_tail(&c.head);
+					clits.clear();
+				}
+				c.num++;
+				nlits = 0;
+				isxor = false;
+			} else if (temp < -c.v_max || temp > c.v_max) {
+				c.error = EINVAL;
+				return;
+			} else {
+				if (c.plits != 0)
+					c.plits->push_back(temp);
+				else
+					clits.push_back(temp);
+				nlits++;
+			}
+			break;
+		case 'x':
+			if (nlits != 0 || isxor) {
+				c.error = EINVAL;
+				return;
+			}
+			isxor = true;
+			ptr++;
+			break;
+		default:
+			ptr = hpsat_next_line(ptr, end);
+			start = true;
+			break;
+		}
 	}
+}
+
+static int
+hpsat_cnf_map(int fd, EQ_HEAD_t *phead, std::vector<ssize_t> *plits,
+    ssize_t &v_max)
+{
+	struct stat st;
+	const char *base;
+	const char *ptr;
+	const char *end;
+	ssize_t nexpr = 0;
+	size_t nchunks;
+	size_t total;
+	hpsat_cnf_chunk *pc;
+	int error = 0;
+
+	v_max = 0;
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+		return (EINVAL);
+
+	base = (const char *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		return (EINVAL);
+	end = base + st.st_size;
+
+#ifdef MADV_SEQUENTIAL
+	madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+#endif
+	for (ptr = base; ptr != end; ) {
+		const char *next = hpsat_next_line(ptr, end);
+
+		if (*ptr == 'c') {
+			fwrite(ptr, next - ptr, 1, stderr);
+			if (next[-1] != '\n')
+				fputc('\n', stderr);
+		} else if (*ptr == 'p') {
+			ptr++;
+			hpsat_skip_space(ptr, end);
+			if (end - ptr < 3 || memcmp(ptr, "cnf", 3) != 0)
+				goto error;
+			ptr += 3;
+			hpsat_skip_space(ptr, end);
+			v_max = hpsat_read_value(ptr, end);
+			hpsat_skip_space(ptr, end);
+			nexpr = hpsat_read_value(ptr, end);
+			ptr = next;
+			break;
+		}
+		ptr = next;
+	}
+	if (v_max <= 0 || nexpr <= 0)
+		goto error;
+
+	fprintf(stderr, "c Variables = %zu\n", v_max);
+	fprintf(stderr, "c Expressions = %zu\n", nexpr);
+
+	/* split the file at clause boundaries */
+	nchunks = 4 * hpsat_nthreads();
+	if (nchunks > (size_t)(end - ptr) / (1UL << 20) + 1)
+		nchunks = (size_t)(end - ptr) / (1UL << 20) + 1;
+
+	pc = new hpsat_cnf_chunk [nchunks];
+
+	for (size_t x = 0; x != nchunks; x++) {
+		pc[x].ptr = x ? pc[x - 1].end : ptr;
+		if (x == nchunks - 1)
+			pc[x].end = end;
+		else
+			pc[x].end = hpsat_clause_boundary(pc[x].ptr +
+			    (end - pc[x].ptr) / (nchunks - x), end);
+		pc[x].v_max = v_max;
+		TAILQ_INIT(&pc[x].head);
+		pc[x].plits = plits ? new std::vector<ssize_t>() : 0;
+		pc[x].num = 0;
+		pc[x].error = 0;
+	}
+
+	hpsat_parallel(nchunks, &hpsat_cnf_parse, pc);
+
+	/*
+	 * A chunk stops parsing at the first bad clause, which is
+	 * only an error if it is within the given clause count.
+	 */
+	total = 0;
+	for (size_t x = 0; x != nchunks; x++) {
+		if (pc[x].error != 0 && total + pc[x].num < (size_t)nexpr)
+			error = pc[x].error;
+		total += pc[x].num;
+		if (plits != 0) {
+			plits->insert(plits->end(), pc[x].plits->begin(),
+			    pc[x].plits->end());
+			delete pc[x].plits;
+		} else {
+			TAILQ_CONCAT(phead, &pc[x].head, entry);
+		}
+	}
+	delete [] pc;
+
+	if (error != 0 || total < (size_t)nexpr)
+		goto error;
+
+	/* ignore any clauses beyond the given count */
+	while (total-- != (size_t)nexpr) {
+		if (plits != 0) {
+			do {
+				plits->pop_back();
+			} while (!plits->empty() && plits->back() != 0 &&
+			    plits->back() != HPSAT_CNF_XOR);
+		} else {
+			delete TAILQ_LAST(phead, EQ_HEAD)->remove(phead);
+		}
+	}
+
+	munmap((void *)base, st.st_size);
 	return (0);
 error:
+	munmap((void *)base, st.st_size);
 	return (EINVAL);
 }
+
+int
+EQ :: from_cnf(int fd)
+{
+	EQ all(HPSAT_VAR_ORED);
+	ssize_t v_max;
+	EQ *peq;
+
+	if (hpsat_cnf_map(fd, &all.head, 0, v_max) != 0)
+		return (EINVAL);
+
+	peq = new EQ();
+	*peq = *this;
+	peq->insert_tail(&all.head);
+
+	*this = all.sort();
+	return (0);
+}
+
+/* clause database */
+
+int
+EQ_CNF :: from_cnf(std::istream &in)
+{
+	ssize_t v_max;
+
+	if (hpsat_cnf_stream(in, 0, &lits, v_max) != 0)
+		return (EINVAL);
+	if (v_max > nvars)
+		nvars = v_max;
+	return (0);
+}
+
+int
+EQ_CNF :: from_cnf(int fd)
+{
+	ssize_t v_max;
+
+	if (hpsat_cnf_map(fd, 0, &lits, v_max) != 0)
+		return (EINVAL);
+	if (v_max > nvars)
+		nvars = v_max;
+	return (0);
+}
+
+void
+EQ_CNF :: add(const ssize_t *plit, size_t num)
+{
+	for (size_t x = 0; x != num; x++) {
+		const ssize_t v = (plit[x] < 0) ? -plit[x] : plit[x];
+
+		if (v > nvars)
+			nvars = v;
+		lits.push_back(plit[x]);
+	}
+	lits.push_back(0);
+}
+
+void
+EQ_CNF :: add_xor(const ssize_t *plit, size_t num)
+{
+	add(plit, num);
+	lits.back() = HPSAT_CNF_XOR;
+}
+
+size_t
+EQ_CNF :: size(void) const
+{
+	size_t retval = 0;
+
+	for (ssize_t lit : lits)
+		retval += (lit == 0 || lit == HPSAT_CNF_XOR);
+	return (retval);
+}
+
+EQ
+EQ_CNF :: toEQ(void) const
+{
+	EQ all(HPSAT_VAR_ORED);
+	size_t start = 0;
+	EQ *peq;
+
+	for (size_t x = 0; x != lits.size(); x++) {
+		const ssize_t lit = lits[x];
+
+		if (lit == HPSAT_CNF_XOR)
+			peq = new EQ(hpsat_xor_literals(lits.data() + start,
+			    x - start));
+		else if (lit == 0)
+			peq = new EQ(hpsat_clause_literals(lits.data() + start,
+			    x - start));
+		else
+			continue;
+		start = x + 1;
+		peq->insert_tail(&all.head);
+	}
+	all.sort();
+	return (all);
+}
@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+/*
+ * An expression is compiled into a flat array in prefix order. A
+ * group is emitted as its type, followed by the offset of its closing
+ * marker, followed by its children and the closing marker. Variables
+ * and constants are emitted as is. This allows evaluation to skip the
+ * remaining children of an OR or AND group once its value is known.
+ */
+
+#define	HPSAT_CODE_CLOSE HPSAT_VAR_MAX
+
+struct hpsat_frame {
+	hpsat_var_t op;
+	size_t end;
+	bool acc;
+};
+
+struct hpsat_compile_frame {
+	const EQ *pe;
+	const EQ *pnext;
+	size_t start;
+};
+
+static void
+hpsat_compile_size(const EQ &eq, size_t &ncode, size_t &ndepth)
+{
+	hpsat_stack<std::pair<const EQ *, size_t> > stack;
+
+	stack.push({ &eq, 0 });
+
+	while (!stack.empty()) {
+		const EQ *pe = stack.top().first;
+		size_t depth = stack.top().second;
+
+		stack.pop();
+
+		switch (pe->var) {
+		case HPSAT_VAR_XORED:
+		case HPSAT_VAR_ORED:
+		case HPSAT_VAR_ANDED:
+			ncode += 3;
+			if (++depth > ndepth)
+				ndepth = depth;
+			for (EQ *peq = pe->first(); peq; peq = peq->next()) {
+				switch (peq->var) {
+				case HPSAT_VAR_XORED:
+				case HPSAT_VAR_ORED:
+				case HPSAT_VAR_ANDED:
+					stack.push({ peq, depth });
+					break;
+				default:
+					ncode += 1;
+					break;
+				}
+			}
+			break;
+		default:
+			ncode += 1;
+			break;
+		}
+	}
+}
+
+static void
+hpsat_compile(const EQ &eq, hpsat_var_t *pcode, size_t &offset)
+{
+	hpsat_stack<hpsat_compile_frame> stack;
+	const EQ *pe = &eq;
+
+descend:
+	switch (pe->var) {
+	case HPSAT_VAR_XORED:
+	case HPSAT_VAR_ORED:
+	case HPSAT_VAR_ANDED:
+		stack.push({ pe, pe->first(), offset });
+		pcode[offset++] = pe->var;
+		offset++;
+		break;
+	default:
+		pcode[offset++] = pe->var;
+		break;
+	}
+
+	while (!stack.empty()) {
+		hpsat_compile_frame &f = stack.top();
+
+		if (f.pnext != 0) {
+			pe = f.pnext;
+			f.pnext = pe->next();
+			goto descend;
+		}
+		pcode[f.start + 1] = offset;
+		pcode[offset++] = HPSAT_CODE_CLOSE;
+		stack.pop();
+	}
+}
+
+EQC &
+EQC :: compile(const EQ &eq)
+{
+	size_t offset = 0;
+
+	delete [] pcode;
+
+	ncode = 0;
+	ndepth = 0;
+	hpsat_compile_size(eq, ncode, ndepth);
+
+	pcode = new hpsat_var_t [ncode];
+	hpsat_compile(eq, pcode, offset);
+	assert(offset == ncode);
+	return (*this);
+}
+
+bool
+EQC :: eval(const uint8_t *pval) const
+{
+	hpsat_frame stack[64];
+	hpsat_frame *pf = (ndepth > 64) ? new hpsat_frame [ndepth] : stack;
+	size_t sp = 0;
+	bool value = false;
+
+	for (size_t pc = 0; pc != ncode; ) {
+		const hpsat_var_t code = pcode[pc];
+
+		switch (code) {
+		case HPSAT_VAR_ZERO:
+			value = false;
+			pc++;
+			break;
+		case HPSAT_VAR_ONE:
+			value = true;
+			pc++;
+			break;
+		case HPSAT_VAR_XORED:
+		case HPSAT_VAR_ORED:
+		case HPSAT_VAR_ANDED:
+			pf[sp].op = code;
+			pf[sp].end = pcode[pc + 1];
+			pf[sp].acc = (code == HPSAT_VAR_ANDED);
+			sp++;
+			pc += 2;
+			continue;
+		case HPSAT_CODE_CLOSE:
+			value = pf[--sp].acc;
+			pc++;
+			break;
+		default:
+			value = (pval[code] != 0);
+			pc++;
+			break;
+		}
+
+		if (sp == 0)
+			break;
+
+		/* accumulate into the parent group */
+		hpsat_frame &f = pf[sp - 1];
+
+		switch (f.op) {
+		case HPSAT_VAR_XORED:
+			f.acc ^= value;
+			break;
+		case HPSAT_VAR_ORED:
+			if (value) {
+				f.acc = true;
+				pc = f.end;
+			}
+			break;
+		default:
+			if (!value) {
+				f.acc = false;
+				pc = f.end;
+			}
+			break;
+		}
+	}
+
+	if (pf != stack)
+		delete [] pf;
+	return (value);
+}
+
+/*
+ * Bit-sliced evaluation. Every variable is given as one or more 64-bit
+ * words, one bit per assignment, so that many assignments are
+ * evaluated in a single pass.
+ */
+
+typedef uint64_t hpsat_v4_t __attribute__((vector_size(32)));
+typedef uint64_t hpsat_v8_t __attribute__((vector_size(64)));
+
+static inline __attribute__((always_inline)) bool
+hpsat_all_zero(const uint64_t &w)
+{
+	return (w == 0);
+}
+
+static inline __attribute__((always_inline)) bool
+hpsat_all_zero(const hpsat_v4_t &w)
+{
+	return ((w[0] | w[1] | w[2] | w[3]) == 0);
+}
+
+static inline __attribute__((always_inline)) bool
+hpsat_all_zero(const hpsat_v8_t &w)
+{
+	return ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) == 0);
+}
+
+template <typename W>
+struct hpsat_wframe {
+	hpsat_var_t op;
+	size_t end;
+	W acc;
+};
+
+template <typename W>
+static inline __attribute__((always_inline)) void
+hpsat_eval_lanes(const EQC &c, const uint64_t *pval, uint64_t *pout)
+{
+	const size_t nword = sizeof(W) / sizeof(uint64_t);
+	hpsat_wframe<W> stack[64];
+	hpsat_wframe<W> *pf = (c.ndepth > 64) ?
+	    new hpsat_wframe<W> [c.ndepth] : stack;
+	const W zero = {};
+	const W ones = ~zero;
+	size_t sp = 0;
+	W value = zero;
+
+	for (size_t pc = 0; pc != c.ncode; ) {
+		const hpsat_var_t code = c.pcode[pc];
+
+		switch (code) {
+		case HPSAT_VAR_ZERO:
+			value = zero;
+			pc++;
+			break;
+		case HPSAT_VAR_ONE:
+			value = ones;
+			pc++;
+			break;
+		case HPSAT_VAR_XORED:
+		case HPSAT_VAR_ORED:
+		case HPSAT_VAR_ANDED:
+			pf[sp].op = code;
+			pf[sp].end = c.pcode[pc + 1];
+			pf[sp].acc = (code == HPSAT_VAR_ANDED) ? ones : zero;
+			sp++;
+			pc += 2;
+			continue;
+		case HPSAT_CODE_CLOSE:
+			value = pf[--sp].acc;
+			pc++;
+			break;
+		default:
+			memcpy(&value, pval + code * nword, sizeof(value));
+			pc++;
+			break;
+		}
+
+		if (sp == 0)
+			break;
+
+		/* accumulate into the parent group */
+		hpsat_wframe<W> &f = pf[sp - 1];
+
+		switch (f.op) {
+		case HPSAT_VAR_XORED:
+			f.acc ^= value;
+			break;
+		case HPSAT_VAR_ORED:
+			f.acc |= value;
+			if (hpsat_all_zero(~f.acc))
+				pc = f.end;
+			break;
+		default:
+			f.acc &= value;
+			if (hpsat_all_zero(f.acc))
+				pc = f.end;
+			break;
+		}
+	}
+
+	if (pf != stack)
+		delete [] pf;
+	memcpy(pout, &value, sizeof(value));
+}
+
+static void
+hpsat_eval_v4(const EQC &c, const uint64_t *pval, uint64_t *pout)
+{
+	hpsat_eval_lanes<hpsat_v4_t>(c, pval, pout);
+}
+
+static void
+hpsat_eval_v8(const EQC &c, const uint64_t *pval, uint64_t *pout)
+{
+	hpsat_eval_lanes<hpsat_v8_t>(c, pval, pout);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static void
+hpsat_eval_v4_avx2(const EQC &c, const uint64_t *pval, uint64_t *pout)
+{
+	hpsat_eval_lanes<hpsat_v4_t>(c, pval, pout);
+}
+
+__attribute__((target("avx512f"))) static void
+hpsat_eval_v8_avx512(const EQC &c, const uint64_t *pval, uint64_t *pout)
+{
+	hpsat_eval_lanes<hpsat_v8_t>(c, pval, pout);
+}
+#endif
+
+uint64_t
+EQC :: eval(const uint64_t *pval) const
+{
+	uint64_t value;
+
+	hpsat_eval_lanes<uint64_t>(*this, pval, &value);
+	return (value);
+}
+
+size_t
+EQC :: words(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx512f"))
+		return (8);
+#endif
+	return (4);
+}
+
+void
+EQC :: eval(const uint64_t *pval, uint64_t *pout, size_t nword) const
+{
+	switch (nword) {
+	case 1:
+		*pout = eval(pval);
+		break;
+	case 4:
+#if defined(__x86_64__)
+		if (__builtin_cpu_supports("avx2")) {
+			hpsat_eval_v4_avx2(*this, pval, pout);
+			break;
+		}
+#endif
+		hpsat_eval_v4(*this, pval, pout);
+		break;
+	case 8:
+#if defined(__x86_64__)
+		if (__builtin_cpu_supports("avx512f")) {
+			hpsat_eval_v8_avx512(*this, pval, pout);
+			break;
+		}
+#endif
+		hpsat_eval_v8(*this, pval, pout);
+		break;
+	default:
+		assert(0);
+		break;
+	}
+}
@@ -0,0 +1,343 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+/*
+ * The DAG stores every structurally unique expression exactly once.
+ * Nodes are immutable and children are kept in the same canonical
+ * order as EQ::sort() produces, using the same structural hash, so
+ * that two nodes are equal if and only if their pointers are equal.
+ */
+
+static size_t
+hpsat_dag_hash(hpsat_var_t var, const EQ_NODE * const *pchild, size_t num)
+{
+	size_t hash = hpsat_hash_var(var);
+
+	for (size_t x = 0; x != num; x++)
+		hash = hpsat_hash_mix(hash, pchild[x]->hash);
+	return (hash);
+}
+
+EQ_DAG :: EQ_DAG()
+{
+	mask = 255;
+	count = 0;
+	ptable = new EQ_NODE * [mask + 1];
+	memset(ptable, 0, sizeof(ptable[0]) * (mask + 1));
+}
+
+EQ_DAG :: ~EQ_DAG()
+{
+	for (size_t x = 0; x <= mask; x++) {
+		EQ_NODE *pn;
+
+		while ((pn = ptable[x]) != 0) {
+			ptable[x] = pn->hnext;
+			free(pn);
+		}
+	}
+	delete [] ptable;
+}
+
+struct hpsat_dag_compare {
+	const EQ_NODE *pa;
+	const EQ_NODE *pb;
+	size_t x;
+};
+
+static inline int
+hpsat_dag_compare_node(const EQ_NODE *pa, const EQ_NODE *pb)
+{
+	if (pa->var > pb->var)
+		return (1);
+	else if (pa->var < pb->var)
+		return (-1);
+	else if (pa->hash > pb->hash)
+		return (1);
+	else if (pa->hash < pb->hash)
+		return (-1);
+	else
+		return (0);
+}
+
+int
+EQ_DAG :: compare(const EQ_NODE *pa, const EQ_NODE *pb)
+{
+	int cmp;
+
+	if (pa == pb)
+		return (0);
+	cmp = hpsat_dag_compare_node(pa, pb);
+	if (cmp != 0)
+		return (cmp);
+
+	/* compare the children in order */
+	hpsat_stack<hpsat_dag_compare> stack;
+
+	stack.push({ pa, pb, 0 });
+
+	while (1) {
+		hpsat_dag_compare &f = stack.top();
+
+		if (f.x == f.pa->num || f.x == f.pb->num) {
+			cmp = (f.pa->num > f.pb->num) - (f.pa->num < f.pb->num);
+			if (cmp != 0)
+				return (cmp);
+			stack.pop();
+			if (stack.empty())
+				return (0);
+			continue;
+		}
+
+		pa = f.pa->child[f.x];
+		pb = f.pb->child[f.x];
+		f.x++;
+
+		/* shared nodes are equal */
+		if (pa == pb)
+			continue;
+		cmp = hpsat_dag_compare_node(pa, pb);
+		if (cmp != 0)
+			return (cmp);
+		if (pa->num != 0 || pb->num != 0)
+			stack.push({ pa, pb, 0 });
+	}
+}
+
+const EQ_NODE *
+EQ_DAG :: lookup(hpsat_var_t var, const EQ_NODE * const *pchild, size_t num)
+{
+	const size_t hash = hpsat_dag_hash(var, pchild, num);
+	EQ_NODE *pn;
+
+	for (pn = ptable[hash & mask]; pn; pn = pn->hnext) {
+		if (pn->hash != hash || pn->var != var || pn->num != num)
+			continue;
+		/* children are unique, so compare pointers only */
+		size_t x;
+		for (x = 0; x != num; x++) {
+			if (pn->child[x] != pchild[x])
+				break;
+		}
+		if (x == num)
+			return (pn);
+	}
+
+	/* grow hash table */
+	if (count > mask) {
+		const size_t nmask = 2 * mask + 1;
+		EQ_NODE **pt = new EQ_NODE * [nmask + 1];
+
+		memset(pt, 0, sizeof(pt[0]) * (nmask + 1));
+
+		for (size_t x = 0; x <= mask; x++) {
+			while ((pn = ptable[x]) != 0) {
+				ptable[x] = pn->hnext;
+				pn->hnext = pt[pn->hash & nmask];
+				pt[pn->hash & nmask] = pn;
+			}
+		}
+		delete [] ptable;
+		ptable = pt;
+		mask = nmask;
+	}
+
+	pn = (EQ_NODE *)malloc(sizeof(*pn) +
+	    (num ? num - 1 : 0) * sizeof(pn->child[0]));
+	if (pn == 0)
+		throw std::bad_alloc();
+	pn->hash = hash;
+	pn->var = var;
+	pn->num = num;
+	for (size_t x = 0; x != num; x++)
+		pn->child[x] = pchild[x];
+	pn->hnext = ptable[hash & mask];
+	ptable[hash & mask] = pn;
+	count++;
+	return (pn);
+}
+
+const EQ_NODE *
+EQ_DAG :: node(hpsat_var_t var, const EQ_NODE * const *pchild, size_t num)
+{
+	if (var != HPSAT_VAR_XORED && var != HPSAT_VAR_ORED &&
+	    var != HPSAT_VAR_ANDED) {
+		assert(num == 0);
+		return (lookup(var, 0, 0));
+	}
+
+	size_t total = 0;
+
+	for (size_t x = 0; x != num; x++)
+		total += (pchild[x]->var == var) ? pchild[x]->num : 1;
+
+	const EQ_NODE **pt = new const EQ_NODE * [total + 1];
+	const EQ_NODE *retval;
+	size_t n = 0;
+
+	/* join same group type and strip constants */
+	for (size_t x = 0; x != num; x++) {
+		const EQ_NODE *pc = pchild[x];
+
+		if (pc->var == var) {
+			for (size_t y = 0; y != pc->num; y++)
+				pt[n++] = pc->child[y];
+			continue;
+		}
+
+		switch (pc->var) {
+		case HPSAT_VAR_ZERO:
+			if (var == HPSAT_VAR_ANDED) {
+				retval = lookup(HPSAT_VAR_ZERO, 0, 0);
+				goto done;
+			}
+			continue;
+		case HPSAT_VAR_ONE:
+			if (var == HPSAT_VAR_ORED) {
+				retval = lookup(HPSAT_VAR_ONE, 0, 0);
+				goto done;
+			} else if (var == HPSAT_VAR_ANDED) {
+				continue;
+			}
+			break;
+		default:
+			break;
+		}
+		pt[n++] = pc;
+	}
+
+	std::sort(pt, pt + n, [](const EQ_NODE *pa, const EQ_NODE *pb) {
+		return (compare(pa, pb) < 0);
+	});
+
+	/* remove duplicates */
+	if (n != 0) {
+		size_t y = 0;
+
+		for (size_t x = 0; x != n; x++) {
+			if (y != 0 && pt[y - 1] == pt[x]) {
+				if (var == HPSAT_VAR_XORED)
+					y--;
+			} else {
+				pt[y++] = pt[x];
+			}
+		}
+		n = y;
+	}
+
+	/* pullup */
+	if (n == 0)
+		retval = lookup((var == HPSAT_VAR_ANDED) ?
+		    HPSAT_VAR_ONE : HPSAT_VAR_ZERO, 0, 0);
+	else if (n == 1)
+		retval = pt[0];
+	else
+		retval = lookup(var, pt, n);
+done:
+	delete [] pt;
+	return (retval);
+}
+
+struct hpsat_dag_intern {
+	const EQ *pe;
+	const EQ *pnext;
+	size_t base;	/* first child in the result stack */
+};
+
+const EQ_NODE *
+EQ_DAG :: intern(const EQ &eq)
+{
+	if (eq.first() == 0)
+		return (node(eq.var));
+
+	hpsat_stack<hpsat_dag_intern> stack;
+	std::vector<const EQ_NODE *> result;
+	const EQ_NODE *pn;
+
+	stack.push({ &eq, eq.first(), 0 });
+
+	/* intern the children before their parent */
+	while (1) {
+		hpsat_dag_intern &f = stack.top();
+		const EQ *pe = f.pnext;
+
+		if (pe != 0) {
+			f.pnext = pe->next();
+			if (pe->first() != 0)
+				stack.push({ pe, pe->first(), result.size() });
+			else
+				result.push_back(node(pe->var));
+			continue;
+		}
+
+		pn = node(f.pe->var, result.data() + f.base,
+		    result.size() - f.base);
+		result.resize(f.base);
+		stack.pop();
+		if (stack.empty())
+			return (pn);
+		result.push_back(pn);
+	}
+}
+
+struct hpsat_dag_expand {
+	const EQ_NODE *pn;
+	EQ *pe;
+	size_t x;
+};
+
+EQ &
+EQ_DAG :: expand(const EQ_NODE *pn, EQ &eq) const
+{
+	hpsat_stack<hpsat_dag_expand> stack;
+
+	eq = EQ(pn->var);
+	stack.push({ pn, &eq, 0 });
+
+	/* update the children before their parent */
+	while (!stack.empty()) {
+		hpsat_dag_expand &f = stack.top();
+
+		if (f.x != f.pn->num) {
+			const EQ_NODE *pc = f.pn->child[f.x++];
+			EQ *peq = new EQ(pc->var);
+
+			peq->insert_tail(&f.pe->head);
+			if (pc->num != 0)
+				stack.push({ pc, peq, 0 });
+			continue;
+		}
+
+		f.pe->update();
+		stack.pop();
+	}
+	return (eq);
+}
@@ -0,0 +1,679 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+/*
+ * EQV keeps the same canonical form, structural hash and ordering as
+ * EQ, so that converting a sorted EQ gives a sorted EQV and back.
+ * Children are scanned sequentially, which is a lot more cache
+ * friendly than following the TAILQ links of EQ.
+ */
+
+struct hpsat_eqv_frame {
+	EQV *pe;
+	uint32_t x;
+};
+
+struct hpsat_eqv_copy {
+	EQV *pdst;
+	const EQV *psrc;
+};
+
+struct hpsat_eqv_conv {
+	EQV *pdst;
+	const EQ *psrc;
+};
+
+struct hpsat_eqv_range {
+	const EQV *pe;
+	const EQV *pend;
+};
+
+struct hpsat_eqv_compare {
+	const EQV *pa;
+	const EQV *pb;
+	uint32_t n;
+	int tail;
+};
+
+struct hpsat_eqv_eval {
+	const EQV *pe;
+	const EQV *pnext;
+	bool acc;
+};
+
+struct hpsat_eqv_print {
+	const EQV *pe;
+	uint32_t x;
+};
+
+struct hpsat_eqv_export {
+	const EQV *ps;
+	EQ *pd;
+	uint32_t x;
+};
+
+static inline bool
+hpsat_eqv_group(uint32_t var)
+{
+	return (var == HPSAT_VAR_XORED || var == HPSAT_VAR_ORED ||
+	    var == HPSAT_VAR_ANDED);
+}
+
+static inline uint32_t
+hpsat_eqv_var(hpsat_var_t var)
+{
+	if (var > UINT32_MAX)
+		throw std::range_error("EQV variable does not fit in 32 bits");
+	return (var);
+}
+
+EQV :: EQV(const EQV &other)
+{
+	var = other.var;
+	num = 0;
+	vmax = other.vmax;
+	hash = other.hash;
+	pchild = 0;
+
+	if (other.num == 0)
+		return;
+
+	hpsat_stack<hpsat_eqv_copy> stack;
+
+	stack.push({ this, &other });
+
+	while (!stack.empty()) {
+		const hpsat_eqv_copy f = stack.top();
+
+		stack.pop();
+
+		/* the number of children is only set once they exist */
+		f.pdst->pchild = new EQV [f.psrc->num];
+		f.pdst->num = f.psrc->num;
+
+		/* push in reverse, so the children are done in order */
+		for (uint32_t x = f.psrc->num; x-- != 0; ) {
+			EQV &d = f.pdst->pchild[x];
+			const EQV &c = f.psrc->pchild[x];
+
+			d.var = c.var;
+			d.vmax = c.vmax;
+			d.hash = c.hash;
+			if (c.num != 0)
+				stack.push({ &d, &c });
+		}
+	}
+}
+
+EQV :: EQV(const EQ &eq)
+{
+	hpsat_stack<hpsat_eqv_conv> stack;
+
+	var = HPSAT_VAR_ZERO;
+	num = 0;
+	pchild = 0;
+
+	stack.push({ this, &eq });
+
+	try {
+		while (!stack.empty()) {
+			const hpsat_eqv_conv f = stack.top();
+			EQV &d = *f.pdst;
+			uint32_t n = 0;
+
+			stack.pop();
+
+			/* the children are done */
+			if (f.psrc == 0) {
+				d.update();
+				continue;
+			}
+
+			d.var = hpsat_eqv_var(f.psrc->var);
+
+			for (EQ *peq = f.psrc->first(); peq; peq = peq->next())
+				n++;
+
+			if (n == 0) {
+				d.update();
+				continue;
+			}
+
+			d.pchild = new EQV [n];
+			d.num = n;
+			stack.push({ &d, 0 });
+
+			/* push in reverse, so the children are done in order */
+			for (EQ *pc = f.psrc->last(); pc; pc = pc->prev()) {
+				EQV &c = d.pchild[--n];
+
+				if (pc->first() != 0) {
+					stack.push({ &c, pc });
+				} else {
+					c.var = hpsat_eqv_var(pc->var);
+					c.update();
+				}
+			}
+		}
+	} catch (...) {
+		if (pchild != 0)
+			release();
+		throw;
+	}
+}
+
+/* free the children, detaching the grandchildren first */
+void
+EQV :: release()
+{
+	hpsat_stack<hpsat_eqv_frame> stack;
+
+	stack.push({ pchild, num });
+	pchild = 0;
+	num = 0;
+
+	while (!stack.empty()) {
+		const hpsat_eqv_frame f = stack.top();
+
+		stack.pop();
+
+		for (uint32_t x = 0; x != f.x; x++) {
+			EQV &c = f.pe[x];
+
+			if (c.pchild == 0)
+				continue;
+			stack.push({ c.pchild, c.num });
+			c.pchild = 0;
+			c.num = 0;
+		}
+		delete [] f.pe;
+	}
+}
+
+void
+EQV :: update()
+{
+	hash = hpsat_hash_var(var);
+	vmax = var;
+
+	for (uint32_t x = 0; x != num; x++) {
+		hash = hpsat_hash_mix(hash, pchild[x].hash);
+		if (pchild[x].vmax > vmax)
+			vmax = pchild[x].vmax;
+	}
+}
+
+bool
+EQV :: contains(hpsat_var_t _var) const
+{
+	if (_var > vmax)
+		return (false);
+	if (var == _var)
+		return (true);
+	if (num == 0)
+		return (false);
+
+	hpsat_stack<hpsat_eqv_range> stack;
+
+	stack.push({ begin(), end() });
+
+	while (!stack.empty()) {
+		hpsat_eqv_range &f = stack.top();
+
+		if (f.pe == f.pend) {
+			stack.pop();
+			continue;
+		}
+
+		const EQV &c = *f.pe++;
+
+		if (_var > c.vmax)
+			continue;
+		if (c.var == _var)
+			return (true);
+		if (c.num != 0)
+			stack.push({ c.begin(), c.end() });
+	}
+	return (false);
+}
+
+static inline int
+hpsat_eqv_compare_node(const EQV &a, const EQV &b)
+{
+	if (a.var > b.var)
+		return (1);
+	else if (a.var < b.var)
+		return (-1);
+	else if (a.hash > b.hash)
+		return (1);
+	else if (a.hash < b.hash)
+		return (-1);
+	else
+		return (0);
+}
+
+static inline hpsat_eqv_compare
+hpsat_eqv_compare_frame(const EQV &a, const EQV &b)
+{
+	const uint32_t n = (a.num < b.num) ? a.num : b.num;
+
+	const hpsat_eqv_compare f = {
+		a.pchild, b.pchild, n, (a.num > n) - (b.num > n)
+	};
+
+	return (f);
+}
+
+int
+EQV :: compare(const EQV &other) const
+{
+	int cmp = hpsat_eqv_compare_node(*this, other);
+
+	if (cmp != 0 || (num == 0 && other.num == 0))
+		return (cmp);
+
+	/* compare the children in order */
+	hpsat_stack<hpsat_eqv_compare> stack;
+
+	stack.push(hpsat_eqv_compare_frame(*this, other));
+
+	while (1) {
+		hpsat_eqv_compare &f = stack.top();
+
+		if (f.n == 0) {
+			if (f.tail != 0)
+				return (f.tail);
+			stack.pop();
+			if (stack.empty())
+				return (0);
+			continue;
+		}
+
+		const EQV &a = *f.pa++;
+		const EQV &b = *f.pb++;
+
+		f.n--;
+
+		cmp = hpsat_eqv_compare_node(a, b);
+		if (cmp != 0)
+			return (cmp);
+		if (a.num != 0 || b.num != 0)
+			stack.push(hpsat_eqv_compare_frame(a, b));
+	}
+}
+
+/*
+ * Same rules as EQ::sort(): constants are removed or select the
+ * result, groups of the same type are joined, equal children cancel in
+ * an XOR and are joined otherwise, a single child is pulled up and an
+ * empty group is the identity of its type. The children must already
+ * be sorted.
+ */
+static void
+hpsat_eqv_sort_node(EQV &e)
+{
+	std::vector<EQV> temp;
+	size_t n = 0;
+
+	if (e.num == 0)
+		goto done;
+
+	assert(hpsat_eqv_group(e.var));
+
+	temp.reserve(e.num);
+
+	for (uint32_t x = 0; x != e.num; x++) {
+		EQV &c = e.pchild[x];
+
+		switch (c.var) {
+		case HPSAT_VAR_ZERO:
+			if (e.var == HPSAT_VAR_ANDED) {
+				e = EQV(HPSAT_VAR_ZERO);
+				return;
+			}
+			continue;
+		case HPSAT_VAR_ONE:
+			if (e.var == HPSAT_VAR_ORED) {
+				e = EQV(HPSAT_VAR_ONE);
+				return;
+			} else if (e.var == HPSAT_VAR_ANDED) {
+				continue;
+			}
+			break;
+		default:
+			break;
+		}
+
+		/* join same group type, the children are already sorted */
+		if (c.var == e.var) {
+			for (uint32_t y = 0; y != c.num; y++)
+				temp.push_back(std::move(c.pchild[y]));
+		} else {
+			temp.push_back(std::move(c));
+		}
+	}
+
+	std::sort(temp.begin(), temp.end(), [](const EQV &a, const EQV &b) {
+		return (a.compare(b) < 0);
+	});
+
+	for (size_t x = 0; x != temp.size(); x++) {
+		if (n != 0 && temp[n - 1].compare(temp[x]) == 0) {
+			if (e.var == HPSAT_VAR_XORED)
+				n--;
+			continue;
+		}
+		if (n != x)
+			temp[n] = std::move(temp[x]);
+		n++;
+	}
+
+	/* pullup */
+	if (n == 1) {
+		EQV c(std::move(temp[0]));
+
+		e = std::move(c);
+		return;
+	}
+
+	/* the old children are all moved from */
+	delete [] e.pchild;
+	e.pchild = 0;
+	e.num = n;
+
+	if (n != 0) {
+		e.pchild = new EQV [n];
+		for (size_t x = 0; x != n; x++)
+			e.pchild[x] = std::move(temp[x]);
+	}
+done:
+	/* check if group is empty */
+	if (e.num == 0 && e.var < HPSAT_VAR_MIN) {
+		e.var = (e.var == HPSAT_VAR_ONE || e.var == HPSAT_VAR_ANDED) ?
+		    HPSAT_VAR_ONE : HPSAT_VAR_ZERO;
+	}
+	e.update();
+}
+
+EQV &
+EQV :: sort()
+{
+	hpsat_stack<hpsat_eqv_frame> stack;
+
+	stack.push({ this, 0 });
+
+	/* sort the children before their parent */
+	while (!stack.empty()) {
+		hpsat_eqv_frame &f = stack.top();
+
+		if (f.x != f.pe->num) {
+			EQV &c = f.pe->pchild[f.x++];
+
+			if (c.num != 0)
+				stack.push({ &c, 0 });
+			else
+				hpsat_eqv_sort_node(c);
+			continue;
+		}
+
+		EQV &e = *f.pe;
+
+		stack.pop();
+		hpsat_eqv_sort_node(e);
+	}
+	return (*this);
+}
+
+EQV &
+EQV :: expand(hpsat_var_t _var, bool _value)
+{
+	const uint32_t value = _value ? HPSAT_VAR_ONE : HPSAT_VAR_ZERO;
+
+	if (var == _var) {
+		var = value;
+		update();
+		return (*this);
+	} else if (_var > vmax) {
+		return (*this);
+	}
+
+	hpsat_stack<hpsat_eqv_frame> stack;
+
+	stack.push({ this, 0 });
+
+	/* update the children before their parent */
+	while (!stack.empty()) {
+		hpsat_eqv_frame &f = stack.top();
+
+		if (f.x != f.pe->num) {
+			EQV &c = f.pe->pchild[f.x++];
+
+			if (c.var == _var) {
+				c.var = value;
+				c.update();
+			} else if (_var <= c.vmax && c.num != 0) {
+				stack.push({ &c, 0 });
+			}
+			continue;
+		}
+
+		f.pe->update();
+		stack.pop();
+	}
+	return (*this);
+}
+
+static inline bool
+hpsat_eqv_eval_leaf(const EQV &e, const uint8_t *pval)
+{
+	switch (e.var) {
+	case HPSAT_VAR_ZERO:
+	case HPSAT_VAR_ORED:
+	case HPSAT_VAR_XORED:
+		return (false);
+	case HPSAT_VAR_ONE:
+	case HPSAT_VAR_ANDED:
+		return (true);
+	default:
+		return (pval[e.var] != 0);
+	}
+}
+
+/* accumulate a child value, returns true when the group is decided */
+static inline bool
+hpsat_eqv_eval_acc(hpsat_eqv_eval &f, bool value)
+{
+	switch (f.pe->var) {
+	case HPSAT_VAR_XORED:
+		f.acc ^= value;
+		return (false);
+	case HPSAT_VAR_ORED:
+		if (!value)
+			return (false);
+		f.acc = true;
+		return (true);
+	default:
+		if (value)
+			return (false);
+		f.acc = false;
+		return (true);
+	}
+}
+
+bool
+EQV :: expand_all(const uint8_t *pval) const
+{
+	hpsat_eqv_eval g = { this, begin(), var == HPSAT_VAR_ANDED };
+
+	/* empty groups evaluate to their identity */
+	if (num == 0)
+		return (hpsat_eqv_eval_leaf(*this, pval));
+
+	/* a group of leaves needs no stack */
+	if (var == HPSAT_VAR_XORED) {
+		for (; g.pnext != end() && g.pnext->num == 0; g.pnext++)
+			g.acc ^= hpsat_eqv_eval_leaf(*g.pnext, pval);
+	} else {
+		const bool stop = (var == HPSAT_VAR_ORED);
+
+		for (; g.pnext != end() && g.pnext->num == 0; g.pnext++) {
+			if (hpsat_eqv_eval_leaf(*g.pnext, pval) == stop)
+				return (stop);
+		}
+	}
+	if (g.pnext == end())
+		return (g.acc);
+
+	hpsat_stack<hpsat_eqv_eval> stack;
+	bool value;
+
+	stack.push(g);
+
+	while (1) {
+		hpsat_eqv_eval &f = stack.top();
+
+		if (f.pnext != f.pe->end()) {
+			const EQV &c = *f.pnext++;
+
+			if (c.num != 0) {
+				stack.push({ &c, c.begin(),
+				    c.var == HPSAT_VAR_ANDED });
+				continue;
+			}
+			if (hpsat_eqv_eval_acc(f, hpsat_eqv_eval_leaf(c, pval)))
+				f.pnext = f.pe->end();
+			continue;
+		}
+
+		/* the group is done, pass its value to the parent */
+		value = f.acc;
+		stack.pop();
+		if (stack.empty())
+			return (value);
+		if (hpsat_eqv_eval_acc(stack.top(), value))
+			stack.top().pnext = stack.top().pe->end();
+	}
+}
+
+EQ
+EQV :: toEQ(void) const
+{
+	EQ retval(var);
+
+	if (num == 0)
+		return (retval);
+
+	hpsat_stack<hpsat_eqv_export> stack;
+
+	stack.push({ this, &retval, 0 });
+
+	/* update the children before their parent */
+	while (!stack.empty()) {
+		hpsat_eqv_export &f = stack.top();
+
+		if (f.x != f.ps->num) {
+			const EQV &c = f.ps->pchild[f.x++];
+			EQ *pn = new EQ(c.var);
+
+			pn->insert_tail(&f.pd->head);
+			if (c.num != 0)
+				stack.push({ &c, pn, 0 });
+			continue;
+		}
+
+		f.pd->update();
+		stack.pop();
+	}
+	return (retval);
+}
+
+static const char *
+hpsat_eqv_op(uint32_t var)
+{
+	switch (var) {
+	case HPSAT_VAR_ORED:
+		return ("|");
+	case HPSAT_VAR_XORED:
+		return ("^");
+	default:
+		return ("&");
+	}
+}
+
+static void
+hpsat_eqv_print_leaf(const EQV &e, std::ostream &out)
+{
+	switch (e.var) {
+	case HPSAT_VAR_ZERO:
+		out << "0";
+		break;
+	case HPSAT_VAR_ONE:
+		out << "1";
+		break;
+	default:
+		out << "v[" << e.var << "]";
+		break;
+	}
+}
+
+void
+EQV :: print(std::ostream &out) const
+{
+	if (!hpsat_eqv_group(var)) {
+		hpsat_eqv_print_leaf(*this, out);
+		return;
+	}
+
+	hpsat_stack<hpsat_eqv_print> stack;
+
+	out << "(";
+	stack.push({ this, 0 });
+
+	while (!stack.empty()) {
+		hpsat_eqv_print &f = stack.top();
+
+		if (f.x == f.pe->num) {
+			out << ")";
+			stack.pop();
+			continue;
+		}
+		if (f.x != 0)
+			out << hpsat_eqv_op(f.pe->var);
+
+		const EQV &c = f.pe->pchild[f.x++];
+
+		if (hpsat_eqv_group(c.var)) {
+			out << "(";
+			stack.push({ &c, 0 });
+		} else {
+			hpsat_eqv_print_leaf(c, out);
+		}
+	}
+}
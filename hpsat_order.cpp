@@ -0,0 +1,243 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+#include <set>
+#include <vector>
+#include <algorithm>
+
+typedef std::vector<hpsat_var_t> hpsat_vars_t;
+
+/*
+ * The interaction graph has an edge between two variables when they
+ * appear in the same top-level term. Eliminating a variable joins all
+ * its neighbours, like the conflict term produced by EQ::solve().
+ */
+
+static void
+hpsat_order_collect(const EQ &eq, hpsat_var_t vmax, hpsat_var_t *pmark,
+    hpsat_var_t stamp, hpsat_vars_t &vars)
+{
+	hpsat_stack<const EQ *> stack;
+
+	stack.push(&eq);
+
+	while (!stack.empty()) {
+		const EQ *pe = stack.top();
+
+		stack.pop();
+
+		switch (pe->var) {
+		case HPSAT_VAR_ZERO:
+		case HPSAT_VAR_ONE:
+			break;
+		case HPSAT_VAR_ORED:
+		case HPSAT_VAR_XORED:
+		case HPSAT_VAR_ANDED:
+			/* push in reverse, to collect in order */
+			for (EQ *peq = pe->last(); peq; peq = peq->prev())
+				stack.push(peq);
+			break;
+		default:
+			if (pe->var < vmax && pmark[pe->var] != stamp) {
+				pmark[pe->var] = stamp;
+				vars.push_back(pe->var);
+			}
+			break;
+		}
+	}
+}
+
+static void
+hpsat_order_term(const EQ &eq, hpsat_var_t vmax, hpsat_var_t *pmark,
+    hpsat_var_t &stamp, size_t *pocc, hpsat_vars_t *padj)
+{
+	hpsat_vars_t vars;
+
+	hpsat_order_collect(eq, vmax, pmark, ++stamp, vars);
+
+	for (size_t x = 0; x != vars.size(); x++) {
+		pocc[vars[x]]++;
+		if (padj == 0)
+			continue;
+		for (size_t y = 0; y != vars.size(); y++) {
+			if (x != y)
+				padj[vars[x]].push_back(vars[y]);
+		}
+	}
+}
+
+static size_t
+hpsat_order_fill(const hpsat_vars_t *padj, hpsat_var_t v)
+{
+	const hpsat_vars_t &nb = padj[v];
+	size_t retval = 0;
+
+	for (size_t x = 0; x != nb.size(); x++) {
+		const hpsat_vars_t &adj = padj[nb[x]];
+
+		for (size_t y = x + 1; y != nb.size(); y++) {
+			if (!std::binary_search(adj.begin(), adj.end(), nb[y]))
+				retval++;
+		}
+	}
+	return (retval);
+}
+
+static size_t
+hpsat_order_score(const hpsat_vars_t *padj, hpsat_var_t v, int how)
+{
+	if (how == HPSAT_ORDER_FILL)
+		return (hpsat_order_fill(padj, v));
+	else
+		return (padj[v].size());
+}
+
+static void
+hpsat_order_greedy(hpsat_vars_t *padj, hpsat_var_t vmax, hpsat_var_t *porder,
+    int how)
+{
+	typedef std::pair<size_t, hpsat_var_t> hpsat_entry_t;
+
+	std::set<hpsat_entry_t> queue;
+	size_t *pscore = new size_t [vmax];
+	hpsat_var_t *pmark = new hpsat_var_t [vmax];
+	hpsat_var_t stamp = 0;
+	size_t n = 0;
+
+	memset(pmark, 0, sizeof(pmark[0]) * vmax);
+
+	for (hpsat_var_t v = HPSAT_VAR_MIN; v != vmax; v++) {
+		hpsat_vars_t &adj = padj[v];
+
+		std::sort(adj.begin(), adj.end());
+		adj.erase(std::unique(adj.begin(), adj.end()), adj.end());
+	}
+
+	for (hpsat_var_t v = HPSAT_VAR_MIN; v != vmax; v++) {
+		pscore[v] = hpsat_order_score(padj, v, how);
+		queue.insert(hpsat_entry_t(pscore[v], v));
+	}
+
+	while (!queue.empty()) {
+		const hpsat_var_t v = queue.begin()->second;
+		hpsat_vars_t nb;
+
+		queue.erase(queue.begin());
+		porder[n++] = v;
+		nb.swap(padj[v]);
+
+		/* join the neighbours into a clique */
+		for (hpsat_var_t u : nb) {
+			hpsat_vars_t temp;
+
+			std::set_union(padj[u].begin(), padj[u].end(),
+			    nb.begin(), nb.end(), std::back_inserter(temp));
+			temp.erase(std::remove_if(temp.begin(), temp.end(),
+			    [&](hpsat_var_t w) { return (w == u || w == v); }),
+			    temp.end());
+			padj[u].swap(temp);
+		}
+
+		/* the fill of the neighbours' neighbours may change too */
+		hpsat_vars_t update;
+
+		stamp++;
+		for (hpsat_var_t u : nb) {
+			if (pmark[u] != stamp) {
+				pmark[u] = stamp;
+				update.push_back(u);
+			}
+			if (how != HPSAT_ORDER_FILL)
+				continue;
+			for (hpsat_var_t w : padj[u]) {
+				if (pmark[w] != stamp) {
+					pmark[w] = stamp;
+					update.push_back(w);
+				}
+			}
+		}
+
+		for (hpsat_var_t u : update) {
+			queue.erase(hpsat_entry_t(pscore[u], u));
+			pscore[u] = hpsat_order_score(padj, u, how);
+			queue.insert(hpsat_entry_t(pscore[u], u));
+		}
+	}
+
+	delete [] pscore;
+	delete [] pmark;
+}
+
+/*
+ * Compute an elimination order for EQ::solve(). The "porder" array
+ * receives all variables from HPSAT_VAR_MIN to "vmax", exclusive.
+ */
+void
+hpsat_order(const EQ &eq, hpsat_var_t vmax, hpsat_var_t *porder, int how)
+{
+	if (vmax <= HPSAT_VAR_MIN)
+		return;
+
+	const size_t nvars = vmax - HPSAT_VAR_MIN;
+
+	if (how == HPSAT_ORDER_INDEX) {
+		for (size_t x = 0; x != nvars; x++)
+			porder[x] = HPSAT_VAR_MIN + x;
+		return;
+	}
+
+	hpsat_vars_t *padj = (how == HPSAT_ORDER_OCCURRENCE) ?
+	    0 : new hpsat_vars_t [vmax];
+	hpsat_var_t *pmark = new hpsat_var_t [vmax];
+	size_t *pocc = new size_t [vmax];
+	hpsat_var_t stamp = 0;
+
+	memset(pmark, 0, sizeof(pmark[0]) * vmax);
+	memset(pocc, 0, sizeof(pocc[0]) * vmax);
+
+	if (eq.var == HPSAT_VAR_ORED) {
+		for (EQ *peq = eq.first(); peq; peq = peq->next())
+			hpsat_order_term(*peq, vmax, pmark, stamp, pocc, padj);
+	} else {
+		hpsat_order_term(eq, vmax, pmark, stamp, pocc, padj);
+	}
+
+	if (padj == 0) {
+		for (size_t x = 0; x != nvars; x++)
+			porder[x] = HPSAT_VAR_MIN + x;
+		std::stable_sort(porder, porder + nvars,
+		    [&](hpsat_var_t a, hpsat_var_t b) {
+			return (pocc[a] < pocc[b]);
+		});
+	} else {
+		hpsat_order_greedy(padj, vmax, porder, how);
+	}
+
+	delete [] padj;
+	delete [] pmark;
+	delete [] pocc;
+}
@@ -0,0 +1,558 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+#include <algorithm>
+
+/*
+ * CNF preprocessing on the integer clause database. Clauses are kept
+ * sorted by variable. Every removed clause which is needed to recover
+ * a model is pushed on the reconstruction stack, together with a
+ * witness literal, which is set when the clause is not satisfied.
+ */
+
+#define	HPSAT_BVE_OCC 16	/* max occurrences of an eliminated variable */
+#define	HPSAT_BVE_SIZE 24	/* max size of a resolvent */
+#define	HPSAT_PP_ROUNDS 8
+
+typedef std::vector<ssize_t> hpsat_clause_t;
+
+/*
+ * XOR lines are kept aside as sorted variables and the parity of
+ * their sum. Their variables are frozen, so that only the values of
+ * units are substituted into them.
+ */
+struct hpsat_xor {
+	hpsat_clause_t vars;
+	bool odd;
+};
+
+/*
+ * After the first round, only variables whose clauses changed, and
+ * clauses which were added or strengthened, are looked at again.
+ */
+struct hpsat_pp {
+	std::vector<hpsat_clause_t> clause;
+	std::vector<bool> dead;
+	std::vector<std::vector<size_t>> occ;
+	std::vector<int8_t> value;
+	std::vector<bool> touched;
+	std::vector<bool> frozen;
+	std::vector<size_t> changed;
+	std::vector<ssize_t> units;
+	std::vector<ssize_t> &stack;
+	ssize_t nvars;
+	bool unsat;
+
+	hpsat_pp(std::vector<ssize_t> &_stack, ssize_t _nvars) : stack(_stack) {
+		nvars = _nvars;
+		occ.resize(2 * nvars + 2);
+		value.resize(nvars + 1);
+		touched.resize(nvars + 1, true);
+		frozen.resize(nvars + 1);
+		unsat = false;
+	}
+};
+
+static size_t
+hpsat_lit_index(ssize_t lit)
+{
+	return ((lit < 0) ? (2 * -lit + 1) : (2 * lit));
+}
+
+static bool
+hpsat_lit_less(ssize_t a, ssize_t b)
+{
+	const ssize_t va = (a < 0) ? -a : a;
+	const ssize_t vb = (b < 0) ? -b : b;
+
+	return (va < vb || (va == vb && a < b));
+}
+
+static bool
+hpsat_clause_has(const hpsat_clause_t &c, ssize_t lit)
+{
+	return (std::binary_search(c.begin(), c.end(), lit, &hpsat_lit_less));
+}
+
+static void
+hpsat_pp_touch(hpsat_pp &pp, size_t index)
+{
+	for (ssize_t lit : pp.clause[index])
+		pp.touched[(lit < 0) ? -lit : lit] = true;
+}
+
+static void
+hpsat_pp_kill(hpsat_pp &pp, size_t index)
+{
+	pp.dead[index] = true;
+	hpsat_pp_touch(pp, index);
+}
+
+static void
+hpsat_pp_push(hpsat_pp &pp, ssize_t witness, const hpsat_clause_t &c)
+{
+	pp.stack.push_back(witness);
+	for (ssize_t lit : c) {
+		if (lit != witness)
+			pp.stack.push_back(lit);
+	}
+	pp.stack.push_back(0);
+}
+
+/* sort the literals, returns false for tautologies */
+static bool
+hpsat_clause_normalize(hpsat_clause_t &c)
+{
+	std::sort(c.begin(), c.end(), &hpsat_lit_less);
+	c.erase(std::unique(c.begin(), c.end()), c.end());
+
+	for (size_t x = 1; x < c.size(); x++) {
+		if (c[x] == -c[x - 1])
+			return (false);
+	}
+	return (true);
+}
+
+static void
+hpsat_pp_add(hpsat_pp &pp, hpsat_clause_t &c)
+{
+	const size_t index = pp.clause.size();
+
+	if (c.empty())
+		pp.unsat = true;
+	else if (c.size() == 1)
+		pp.units.push_back(c[0]);
+
+	for (ssize_t lit : c)
+		pp.occ[hpsat_lit_index(lit)].push_back(index);
+
+	pp.clause.push_back(hpsat_clause_t());
+	pp.clause.back().swap(c);
+	pp.dead.push_back(false);
+	pp.changed.push_back(index);
+	hpsat_pp_touch(pp, index);
+}
+
+/* substitute assigned variables and cancel pairs */
+static void
+hpsat_xor_normalize(const hpsat_pp &pp, hpsat_xor &x)
+{
+	size_t n = 0;
+
+	for (ssize_t v : x.vars) {
+		if (pp.value[v] == 0)
+			x.vars[n++] = v;
+		else if (pp.value[v] > 0)
+			x.odd = !x.odd;
+	}
+	x.vars.resize(n);
+
+	std::sort(x.vars.begin(), x.vars.end());
+
+	n = 0;
+	for (size_t y = 0; y != x.vars.size(); y++) {
+		if (n != 0 && x.vars[n - 1] == x.vars[y])
+			n--;
+		else
+			x.vars[n++] = x.vars[y];
+	}
+	x.vars.resize(n);
+}
+
+/* collect the live clauses containing the given literal */
+static void
+hpsat_pp_occ(hpsat_pp &pp, ssize_t lit, std::vector<size_t> &list)
+{
+	std::vector<size_t> &occ = pp.occ[hpsat_lit_index(lit)];
+	size_t n = 0;
+
+	list.clear();
+	for (size_t index : occ) {
+		if (pp.dead[index] || !hpsat_clause_has(pp.clause[index], lit))
+			continue;
+		occ[n++] = index;
+		list.push_back(index);
+	}
+	occ.resize(n);
+}
+
+static void
+hpsat_pp_propagate(hpsat_pp &pp)
+{
+	std::vector<size_t> list;
+
+	while (!pp.units.empty() && !pp.unsat) {
+		const ssize_t lit = pp.units.back();
+		const ssize_t v = (lit < 0) ? -lit : lit;
+		const int8_t value = (lit < 0) ? -1 : 1;
+
+		pp.units.pop_back();
+
+		if (pp.value[v] == value)
+			continue;
+		if (pp.value[v] != 0) {
+			pp.unsat = true;
+			break;
+		}
+		pp.value[v] = value;
+		pp.stack.push_back(lit);
+		pp.stack.push_back(0);
+
+		hpsat_pp_occ(pp, lit, list);
+		for (size_t index : list)
+			hpsat_pp_kill(pp, index);
+
+		hpsat_pp_occ(pp, -lit, list);
+		for (size_t index : list) {
+			hpsat_clause_t &c = pp.clause[index];
+
+			c.erase(std::find(c.begin(), c.end(), -lit));
+			pp.changed.push_back(index);
+			hpsat_pp_touch(pp, index);
+			if (c.empty())
+				pp.unsat = true;
+			else if (c.size() == 1)
+				pp.units.push_back(c[0]);
+		}
+	}
+}
+
+static void
+hpsat_pp_duplicates(hpsat_pp &pp)
+{
+	typedef std::pair<size_t, size_t> hpsat_entry_t;
+
+	std::vector<hpsat_entry_t> order;
+
+	for (size_t x = 0; x != pp.clause.size(); x++) {
+		size_t hash = 0;
+
+		if (pp.dead[x])
+			continue;
+		for (ssize_t lit : pp.clause[x])
+			hash = hpsat_hash_mix(hash, lit);
+		order.push_back(hpsat_entry_t(hash, x));
+	}
+
+	std::sort(order.begin(), order.end());
+
+	for (size_t x = 0; x != order.size(); x++) {
+		const size_t a = order[x].second;
+
+		for (size_t y = x + 1; y != order.size() &&
+		    order[y].first == order[x].first; y++) {
+			const size_t b = order[y].second;
+
+			if (!pp.dead[b] && pp.clause[a] == pp.clause[b])
+				pp.dead[b] = true;
+		}
+	}
+}
+
+/* remove the clauses subsumed by the changed clauses */
+static bool
+hpsat_pp_subsume(hpsat_pp &pp)
+{
+	std::vector<size_t> order;
+	std::vector<size_t> list;
+	bool retval = false;
+
+	order.swap(pp.changed);
+	std::sort(order.begin(), order.end());
+	order.erase(std::unique(order.begin(), order.end()), order.end());
+
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return (pp.clause[a].size() < pp.clause[b].size());
+	});
+
+	for (size_t index : order) {
+		const hpsat_clause_t &c = pp.clause[index];
+		ssize_t best = 0;
+		size_t nbest = SIZE_MAX;
+
+		if (pp.dead[index])
+			continue;
+
+		/* only check clauses containing the rarest literal */
+		for (ssize_t lit : c) {
+			const size_t n = pp.occ[hpsat_lit_index(lit)].size();
+			if (n < nbest) {
+				nbest = n;
+				best = lit;
+			}
+		}
+
+		hpsat_pp_occ(pp, best, list);
+		for (size_t other : list) {
+			const hpsat_clause_t &d = pp.clause[other];
+
+			if (other == index || d.size() < c.size())
+				continue;
+			if (std::includes(d.begin(), d.end(),
+			    c.begin(), c.end(), &hpsat_lit_less)) {
+				hpsat_pp_kill(pp, other);
+				retval = true;
+			}
+		}
+	}
+	return (retval);
+}
+
+static bool
+hpsat_pp_pure(hpsat_pp &pp, const std::vector<bool> &touched)
+{
+	std::vector<size_t> pos;
+	std::vector<size_t> neg;
+	bool retval = false;
+
+	for (ssize_t v = 1; v <= pp.nvars; v++) {
+		if (pp.value[v] != 0 || pp.frozen[v] || !touched[v])
+			continue;
+
+		hpsat_pp_occ(pp, v, pos);
+		hpsat_pp_occ(pp, -v, neg);
+
+		if (pos.empty() == neg.empty())
+			continue;
+
+		const ssize_t lit = neg.empty() ? v : -v;
+
+		pp.value[v] = (lit < 0) ? -1 : 1;
+		pp.stack.push_back(lit);
+		pp.stack.push_back(0);
+
+		for (size_t index : neg.empty() ? pos : neg)
+			hpsat_pp_kill(pp, index);
+		retval = true;
+	}
+	return (retval);
+}
+
+/* resolve two clauses on "v", returns false for tautologies */
+static bool
+hpsat_resolve(const hpsat_clause_t &a, const hpsat_clause_t &b, ssize_t v,
+    hpsat_clause_t &r)
+{
+	r.clear();
+	for (ssize_t lit : a) {
+		if (lit != v)
+			r.push_back(lit);
+	}
+	for (ssize_t lit : b) {
+		if (lit != -v)
+			r.push_back(lit);
+	}
+	return (hpsat_clause_normalize(r));
+}
+
+static bool
+hpsat_pp_eliminate(hpsat_pp &pp, const std::vector<bool> &touched)
+{
+	std::vector<hpsat_clause_t> resolvent;
+	std::vector<size_t> pos;
+	std::vector<size_t> neg;
+	hpsat_clause_t r;
+	bool retval = false;
+
+	for (ssize_t v = 1; v <= pp.nvars && !pp.unsat; v++) {
+		if (pp.value[v] != 0 || pp.frozen[v] || !touched[v])
+			continue;
+
+		hpsat_pp_occ(pp, v, pos);
+		hpsat_pp_occ(pp, -v, neg);
+
+		if (pos.empty() || neg.empty() ||
+		    pos.size() + neg.size() > HPSAT_BVE_OCC)
+			continue;
+
+		/* the number of clauses must not grow */
+		resolvent.clear();
+		for (size_t a : pos) {
+			for (size_t b : neg) {
+				if (!hpsat_resolve(pp.clause[a], pp.clause[b],
+				    v, r))
+					continue;
+				if (r.size() > HPSAT_BVE_SIZE ||
+				    resolvent.size() == pos.size() + neg.size())
+					goto next;
+				resolvent.push_back(r);
+			}
+		}
+
+		for (size_t index : pos) {
+			hpsat_pp_push(pp, v, pp.clause[index]);
+			hpsat_pp_kill(pp, index);
+		}
+		for (size_t index : neg) {
+			hpsat_pp_push(pp, -v, pp.clause[index]);
+			hpsat_pp_kill(pp, index);
+		}
+		/* mark the variable as eliminated */
+		pp.value[v] = 2;
+
+		for (hpsat_clause_t &c : resolvent)
+			hpsat_pp_add(pp, c);
+
+		hpsat_pp_propagate(pp);
+		retval = true;
+next:;
+	}
+	return (retval);
+}
+
+/*
+ * Simplify the clause database using unit propagation, pure literal
+ * elimination, duplicate and subsumed clause removal and bounded
+ * variable elimination. The result is equisatisfiable, and a model
+ * of the result is turned into a model of the original clauses by
+ * extend(). Returns false if the clauses are unsatisfiable.
+ */
+bool
+EQ_CNF :: preprocess(void)
+{
+	hpsat_pp pp(stack, nvars);
+	std::vector<hpsat_xor> xors;
+	std::vector<bool> touched;
+	hpsat_clause_t c;
+	hpsat_xor x;
+
+	for (ssize_t lit : lits) {
+		if (lit == HPSAT_CNF_XOR) {
+			x.vars.clear();
+			x.odd = true;
+			for (ssize_t l : c) {
+				x.vars.push_back((l < 0) ? -l : l);
+				x.odd ^= (l < 0);
+			}
+			hpsat_xor_normalize(pp, x);
+
+			if (x.vars.size() == 1) {
+				c.assign(1, x.odd ? x.vars[0] : -x.vars[0]);
+				hpsat_pp_add(pp, c);
+			} else if (!x.vars.empty()) {
+				for (ssize_t v : x.vars)
+					pp.frozen[v] = true;
+				xors.push_back(x);
+			} else if (x.odd) {
+				pp.unsat = true;
+			}
+		} else if (lit != 0) {
+			c.push_back(lit);
+			continue;
+		} else if (hpsat_clause_normalize(c)) {
+			hpsat_pp_add(pp, c);
+		}
+		c.clear();
+	}
+
+	hpsat_pp_duplicates(pp);
+	hpsat_pp_propagate(pp);
+
+	for (size_t round = 0; round != HPSAT_PP_ROUNDS && !pp.unsat; round++) {
+		bool changed = false;
+
+		touched.swap(pp.touched);
+		pp.touched.assign(nvars + 1, false);
+
+		changed |= hpsat_pp_subsume(pp);
+		changed |= hpsat_pp_pure(pp, touched);
+		changed |= hpsat_pp_eliminate(pp, touched);
+		hpsat_pp_propagate(pp);
+
+		if (!changed)
+			break;
+	}
+
+	for (size_t y = 0; y != xors.size() && !pp.unsat; y++) {
+		hpsat_xor_normalize(pp, xors[y]);
+		if (xors[y].vars.empty() && xors[y].odd)
+			pp.unsat = true;
+	}
+
+	lits.clear();
+
+	if (pp.unsat) {
+		/* a single empty clause */
+		lits.push_back(0);
+		return (false);
+	}
+
+	for (size_t x = 0; x != pp.clause.size(); x++) {
+		if (pp.dead[x])
+			continue;
+		lits.insert(lits.end(), pp.clause[x].begin(),
+		    pp.clause[x].end());
+		lits.push_back(0);
+	}
+
+	for (hpsat_xor &xl : xors) {
+		if (xl.vars.empty())
+			continue;
+		if (!xl.odd)
+			xl.vars[0] = -xl.vars[0];
+		lits.insert(lits.end(), xl.vars.begin(), xl.vars.end());
+		lits.push_back(HPSAT_CNF_XOR);
+	}
+	return (true);
+}
+
+/*
+ * Turn a model of the preprocessed clauses into a model of the
+ * original clauses. The model is indexed by EQ variable.
+ */
+void
+EQ_CNF :: extend(uint8_t *pvar) const
+{
+	std::vector<size_t> start;
+
+	for (size_t x = 0; x != stack.size(); x++) {
+		if (x == 0 || stack[x - 1] == 0)
+			start.push_back(x);
+	}
+
+	for (size_t y = start.size(); y-- != 0; ) {
+		const ssize_t *pc = stack.data() + start[y];
+		bool satisfied = false;
+
+		for (const ssize_t *pl = pc; *pl != 0; pl++) {
+			const ssize_t lit = *pl;
+			const hpsat_var_t v =
+			    ((lit < 0) ? -lit : lit) + HPSAT_VAR_MIN - 1;
+
+			if ((pvar[v] != 0) == (lit > 0)) {
+				satisfied = true;
+				break;
+			}
+		}
+
+		if (!satisfied) {
+			const ssize_t w = pc[0];
+
+			pvar[((w < 0) ? -w : w) + HPSAT_VAR_MIN - 1] = (w > 0);
+		}
+	}
+}
@@ -25,97 +25,488 @@
 
 #include "hpsat.h"
 
-static bool
-hpsat_simplify(const EQP entry, EQP *ppeq, bool doInsert)
+#include <algorithm>
+#include <queue>
+
+/*
+ * Gaussian elimination over GF(2) on the linear terms. An OR node is
+ * zero when all its linear children are zero, and an AND node is one
+ * when all its linear children are one, so each linear child gives a
+ * row "r = 0" of a linear system. The rows of every OR and AND node
+ * are brought into reduced row echelon form, using the highest
+ * variable of each row as its pivot, and written back.
+ *
+ * Below an OR or AND node its rows are known to hold. The rows of all
+ * enclosing nodes form the context, which every linear term deeper
+ * down is reduced against. The context is in row echelon form, and
+ * indexed by pivot variable.
+ */
+
+#define	HPSAT_GF2_DENSE (1UL << 27)	/* bits, max dense matrix size */
+#define	HPSAT_GF2_K 8			/* max rows per M4RI table */
+
+typedef uint64_t hpsat_gf2_v4_t __attribute__((vector_size(32)));
+
+struct hpsat_gf2_row {
+	std::vector<hpsat_var_t> vars;	/* decreasing */
+	bool one;
+
+	bool operator <(const hpsat_gf2_row &other) const {
+		return (one < other.one ||
+		    (one == other.one && vars < other.vars));
+	}
+	bool operator ==(const hpsat_gf2_row &other) const {
+		return (one == other.one && vars == other.vars);
+	}
+};
+
+struct hpsat_gf2_ctx {
+	std::vector<hpsat_gf2_row> rows;
+	std::vector<size_t> pivot;	/* context row by variable */
+	std::vector<size_t> column;	/* scratch, per variable */
+	std::vector<uint8_t> mark;	/* scratch, per variable */
+};
+
+static void
+hpsat_gf2_collect(const EQ &eq, hpsat_gf2_row &row)
 {
-	bool any = false;
+	hpsat_stack<const EQ *> stack;
 
-	for (;;) {
-		hpsat_var_t v = entry.p->maxVar();
-
-		if (v >= HPSAT_VAR_MIN) {
-			if (ppeq[v].p == 0) {
-				if (doInsert)
-					ppeq[v] = entry;
-				break;
-			} else if (ppeq[v].s) {
-				*entry.p ^= *ppeq[v].p;
-				*entry.p ^= EQ(HPSAT_VAR_ONE);
-				any = true;
-			} else {
-				*entry.p ^= *ppeq[v].p;
-				any = true;
-			}
-		} else {
+	stack.push(&eq);
+
+	while (!stack.empty()) {
+		const EQ *pe = stack.top();
+
+		stack.pop();
+
+		switch (pe->var) {
+		case HPSAT_VAR_ZERO:
+			break;
+		case HPSAT_VAR_ONE:
+			row.one = !row.one;
+			break;
+		case HPSAT_VAR_XORED:
+			for (EQ *peq = pe->first(); peq; peq = peq->next())
+				stack.push(peq);
+			break;
+		default:
+			row.vars.push_back(pe->var);
 			break;
 		}
 	}
-	return (any);
 }
 
 static void
-hpsat_remove(const EQP entry, EQP *ppeq)
+hpsat_gf2_row_from(const EQ &eq, hpsat_gf2_row &row, bool one)
 {
-	hpsat_var_t v = entry.p->maxVar();
+	size_t n = 0;
+
+	row.vars.clear();
+	row.one = one;
+
+	hpsat_gf2_collect(eq, row);
 
-	if (ppeq[v].p == entry.p)
-		ppeq[v].p = 0;
+	/* cancel pairs */
+	std::sort(row.vars.begin(), row.vars.end(),
+	    std::greater<hpsat_var_t>());
+
+	for (size_t x = 0; x != row.vars.size(); x++) {
+		if (n != 0 && row.vars[n - 1] == row.vars[x])
+			n--;
+		else
+			row.vars[n++] = row.vars[x];
+	}
+	row.vars.resize(n);
 }
 
-bool
-EQ :: simplify(EQP *ppeq)
+static EQ *
+hpsat_gf2_term(const hpsat_gf2_row &row, bool one)
+{
+	EQ *pe = new EQ(HPSAT_VAR_XORED);
+
+	for (hpsat_var_t v : row.vars)
+		(new EQ(v))->insert_tail(&pe->head);
+	if (row.one != one)
+		(new EQ(HPSAT_VAR_ONE))->insert_tail(&pe->head);
+	pe->sort();
+	return (pe);
+}
+
+static void
+hpsat_gf2_push(hpsat_gf2_ctx &ctx, const hpsat_gf2_row &row)
+{
+	ctx.pivot[row.vars[0]] = ctx.rows.size();
+	ctx.rows.push_back(row);
+}
+
+static void
+hpsat_gf2_pop(hpsat_gf2_ctx &ctx, size_t num)
+{
+	while (ctx.rows.size() != num) {
+		ctx.pivot[ctx.rows.back().vars[0]] = SIZE_MAX;
+		ctx.rows.pop_back();
+	}
+}
+
+/* remove all pivot variables of the context, returns true if changed */
+static bool
+hpsat_gf2_reduce(hpsat_gf2_ctx &ctx, hpsat_gf2_row &row)
 {
+	std::priority_queue<hpsat_var_t> heap;
 	bool any = false;
 
-	switch (var) {
-	case HPSAT_VAR_ORED:
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == true) {
-				const EQP entry = {peq,false};
-				any |= hpsat_simplify(entry, ppeq, true);
-			}
+	for (hpsat_var_t v : row.vars)
+		any |= (ctx.pivot[v] != SIZE_MAX);
+	if (!any)
+		return (false);
+
+	for (hpsat_var_t v : row.vars) {
+		ctx.mark[v] = 1;
+		heap.push(v);
+	}
+	row.vars.clear();
+
+	/* the other variables of a pivot row are all below its pivot */
+	while (!heap.empty()) {
+		const hpsat_var_t v = heap.top();
+
+		heap.pop();
+		if (ctx.mark[v] == 0)
+			continue;
+		ctx.mark[v] = 0;
+
+		const size_t p = ctx.pivot[v];
+
+		if (p == SIZE_MAX) {
+			row.vars.push_back(v);
+			continue;
 		}
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == false)
-				any |= peq->simplify(ppeq);
+		for (hpsat_var_t u : ctx.rows[p].vars) {
+			if (u == v)
+				continue;
+			ctx.mark[u] ^= 1;
+			if (ctx.mark[u])
+				heap.push(u);
 		}
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == true) {
-				const EQP entry = {peq,false};
-				hpsat_remove(entry, ppeq);
-			}
+		row.one ^= ctx.rows[p].one;
+	}
+	return (true);
+}
+
+static inline bool
+hpsat_gf2_bit(const hpsat_gf2_v4_t *prow, size_t c)
+{
+	return ((prow[c / 256][(c / 64) % 4] >> (c % 64)) & 1);
+}
+
+static inline void
+hpsat_gf2_xor(hpsat_gf2_v4_t *pa, const hpsat_gf2_v4_t *pb, size_t nw)
+{
+	for (size_t x = 0; x != nw; x++)
+		pa[x] ^= pb[x];
+}
+
+/*
+ * Dense elimination on a bit-packed matrix, using the method of the
+ * four Russians: up to HPSAT_GF2_K pivot rows are found at a time, and
+ * all other rows are reduced by them with a single row operation, from
+ * a table of all their combinations.
+ */
+static void
+hpsat_gf2_dense(hpsat_gf2_ctx &ctx, std::vector<hpsat_gf2_row> &rows,
+    const std::vector<hpsat_var_t> &cols)
+{
+	const size_t m = rows.size();
+	const size_t ncols = cols.size();
+	const size_t nw = (ncols + 1 + 255) / 256;
+	std::vector<hpsat_gf2_v4_t> mat(m * nw);
+	std::vector<hpsat_gf2_v4_t> table;
+	size_t k = 1;
+	size_t r = 0;
+
+	for (size_t x = 0; x != ncols; x++)
+		ctx.column[cols[x]] = x;
+
+	/* the constant is the last column */
+	for (size_t i = 0; i != m; i++) {
+		hpsat_gf2_v4_t *pi = &mat[i * nw];
+
+		for (hpsat_var_t v : rows[i].vars) {
+			const size_t c = ctx.column[v];
+			pi[c / 256][(c / 64) % 4] |= 1ULL << (c % 64);
 		}
-		break;
-	case HPSAT_VAR_ANDED:
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == true) {
-				const EQP entry = {peq,true};
-				any |= hpsat_simplify(entry, ppeq, true);
+		if (rows[i].one)
+			pi[ncols / 256][(ncols / 64) % 4] |=
+			    1ULL << (ncols % 64);
+	}
+
+	while (k < HPSAT_GF2_K && (2UL << k) <= m)
+		k++;
+	table.resize(nw << k);
+
+	for (size_t c = 0; r != m && c != ncols; ) {
+		size_t pc[HPSAT_GF2_K];
+		size_t kk = 0;
+
+		/* find pivots, keeping them reduced against each other */
+		for (; c != ncols && kk != k && r + kk != m; c++) {
+			size_t i;
+
+			for (i = r + kk; i != m; i++) {
+				hpsat_gf2_v4_t *pi = &mat[i * nw];
+
+				for (size_t j = 0; j != kk; j++) {
+					if (hpsat_gf2_bit(pi, pc[j]))
+						hpsat_gf2_xor(pi,
+						    &mat[(r + j) * nw], nw);
+				}
+				if (hpsat_gf2_bit(pi, c))
+					break;
 			}
+			if (i == m)
+				continue;
+
+			hpsat_gf2_v4_t *pp = &mat[(r + kk) * nw];
+
+			if (i != r + kk)
+				std::swap_ranges(pp, pp + nw, &mat[i * nw]);
+
+			for (size_t j = 0; j != kk; j++) {
+				hpsat_gf2_v4_t *pj = &mat[(r + j) * nw];
+
+				if (hpsat_gf2_bit(pj, c))
+					hpsat_gf2_xor(pj, pp, nw);
+			}
+			pc[kk++] = c;
 		}
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == false)
-				any |= peq->simplify(ppeq);
+		if (kk == 0)
+			break;
+
+		/* all combinations of the pivot rows */
+		for (size_t x = 0; x != nw; x++)
+			table[x] = hpsat_gf2_v4_t{};
+		for (size_t g = 1; g != (1UL << kk); g++) {
+			hpsat_gf2_v4_t *pt = &table[g * nw];
+			const hpsat_gf2_v4_t *pg = &table[(g & (g - 1)) * nw];
+
+			std::copy(pg, pg + nw, pt);
+			hpsat_gf2_xor(pt,
+			    &mat[(r + __builtin_ctzl(g)) * nw], nw);
 		}
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == true) {
-				const EQP entry = {peq,true};
-				hpsat_remove(entry, ppeq);
+
+		for (size_t i = 0; i != m; i++) {
+			hpsat_gf2_v4_t *pi = &mat[i * nw];
+			size_t g = 0;
+
+			if (i == r) {
+				i += kk - 1;
+				continue;
 			}
+			for (size_t j = 0; j != kk; j++)
+				g |= (size_t)hpsat_gf2_bit(pi, pc[j]) << j;
+			if (g != 0)
+				hpsat_gf2_xor(pi, &table[g * nw], nw);
 		}
-		break;
-	case HPSAT_VAR_XORED:
-		for (EQ *peq = first(); peq; peq = peq->next()) {
-			if (peq->isXOR() == true) {
-				const EQP entry = {peq,false};
-				any |= hpsat_simplify(entry, ppeq, false);
-			} else {
-				any |= peq->simplify(ppeq);
+		r += kk;
+	}
+
+	/* the remaining rows have no variables */
+	bool conflict = false;
+
+	for (size_t i = r; i != m; i++)
+		conflict |= hpsat_gf2_bit(&mat[i * nw], ncols);
+
+	rows.resize(r);
+
+	for (size_t i = 0; i != r; i++) {
+		const hpsat_gf2_v4_t *pi = &mat[i * nw];
+
+		rows[i].vars.clear();
+		for (size_t c = 0; c != ncols; c++) {
+			if (hpsat_gf2_bit(pi, c))
+				rows[i].vars.push_back(cols[c]);
+		}
+		rows[i].one = hpsat_gf2_bit(pi, ncols);
+		hpsat_gf2_push(ctx, rows[i]);
+	}
+
+	if (conflict)
+		rows.push_back(hpsat_gf2_row{ {}, true });
+}
+
+/* sparse elimination, for large and sparse systems */
+static void
+hpsat_gf2_sparse(hpsat_gf2_ctx &ctx, std::vector<hpsat_gf2_row> &rows)
+{
+	const size_t start = ctx.rows.size();
+	bool conflict = false;
+
+	for (hpsat_gf2_row &row : rows) {
+		hpsat_gf2_reduce(ctx, row);
+
+		if (!row.vars.empty())
+			hpsat_gf2_push(ctx, row);
+		else
+			conflict |= row.one;
+	}
+
+	/* back substitute, from the lowest pivot and up */
+	std::vector<size_t> order;
+
+	for (size_t x = start; x != ctx.rows.size(); x++)
+		order.push_back(x);
+
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return (ctx.rows[a].vars[0] < ctx.rows[b].vars[0]);
+	});
+
+	for (size_t x : order) {
+		hpsat_gf2_row &row = ctx.rows[x];
+		const hpsat_var_t v = row.vars[0];
+
+		ctx.pivot[v] = SIZE_MAX;
+		hpsat_gf2_reduce(ctx, row);
+		ctx.pivot[v] = x;
+	}
+
+	rows.assign(ctx.rows.begin() + start, ctx.rows.end());
+
+	if (conflict)
+		rows.push_back(hpsat_gf2_row{ {}, true });
+}
+
+/*
+ * Bring the given rows into reduced row echelon form, modulo the
+ * context. The resulting rows are pushed on the context, except for a
+ * row without variables, which is a conflict.
+ */
+static void
+hpsat_gf2_eliminate(hpsat_gf2_ctx &ctx, std::vector<hpsat_gf2_row> &rows)
+{
+	std::vector<hpsat_var_t> cols;
+
+	/* the marks are shared with hpsat_gf2_reduce() */
+	for (hpsat_gf2_row &row : rows)
+		hpsat_gf2_reduce(ctx, row);
+
+	for (const hpsat_gf2_row &row : rows) {
+		for (hpsat_var_t v : row.vars) {
+			if (ctx.mark[v] == 0) {
+				ctx.mark[v] = 1;
+				cols.push_back(v);
 			}
 		}
-		break;
-	default:
-		break;
+	}
+	for (hpsat_var_t v : cols)
+		ctx.mark[v] = 0;
+
+	if (rows.size() * (cols.size() + 1) <= HPSAT_GF2_DENSE) {
+		std::sort(cols.begin(), cols.end(),
+		    std::greater<hpsat_var_t>());
+		hpsat_gf2_dense(ctx, rows, cols);
+	} else {
+		hpsat_gf2_sparse(ctx, rows);
+	}
+}
+
+struct hpsat_gf2_frame {
+	EQ *pe;
+	EQ *pnext;
+	size_t num;	/* context size on entry */
+};
+
+/*
+ * Reduce the linear terms of an OR or AND group against the context,
+ * and add them to the context. Returns true if changed.
+ */
+static bool
+hpsat_gf2_enter(EQ &eq, hpsat_gf2_ctx &ctx)
+{
+	std::vector<hpsat_gf2_row> orig;
+	std::vector<hpsat_gf2_row> rows;
+	hpsat_gf2_row row;
+	bool one;
+	EQ *peq;
+	EQ *pfq;
+
+	if (eq.var != HPSAT_VAR_ORED && eq.var != HPSAT_VAR_ANDED)
+		return (false);
+
+	one = (eq.var == HPSAT_VAR_ANDED);
+
+	for (peq = eq.first(); peq; peq = peq->next()) {
+		if (peq->isXOR() == false)
+			continue;
+		hpsat_gf2_row_from(*peq, row, one);
+		rows.push_back(row);
+	}
+
+	if (rows.empty())
+		return (false);
+
+	orig = rows;
+	hpsat_gf2_eliminate(ctx, rows);
+
+	std::sort(orig.begin(), orig.end());
+	std::sort(rows.begin(), rows.end());
+
+	if (orig == rows)
+		return (false);
+
+	for (peq = eq.first(); peq; peq = pfq) {
+		pfq = peq->next();
+		if (peq->isXOR() == true)
+			delete peq->remove(&eq.head);
+	}
+	for (const hpsat_gf2_row &r : rows)
+		hpsat_gf2_term(r, one)->insert_tail(&eq.head);
+	return (true);
+}
+
+/*
+ * Walk the non-linear nodes depth first. The context of an OR or AND
+ * group is dropped again when the walk leaves the group, and the
+ * linear terms of an XOR group are reduced against it.
+ */
+static bool
+hpsat_gf2_simplify(EQ &eq, hpsat_gf2_ctx &ctx)
+{
+	hpsat_stack<hpsat_gf2_frame> stack;
+	hpsat_gf2_row row;
+	size_t num = ctx.rows.size();
+	bool any = hpsat_gf2_enter(eq, ctx);
+
+	stack.push({ &eq, eq.first(), num });
+
+	while (!stack.empty()) {
+		hpsat_gf2_frame &f = stack.top();
+		EQ *peq = f.pnext;
+
+		if (peq == 0) {
+			hpsat_gf2_pop(ctx, f.num);
+			stack.pop();
+			continue;
+		}
+		f.pnext = peq->next();
+
+		if (peq->isXOR() == false) {
+			num = ctx.rows.size();
+			any |= hpsat_gf2_enter(*peq, ctx);
+			stack.push({ peq, peq->first(), num });
+			continue;
+		}
+		if (f.pe->var != HPSAT_VAR_XORED)
+			continue;
+
+		hpsat_gf2_row_from(*peq, row, false);
+		if (hpsat_gf2_reduce(ctx, row) == false)
+			continue;
+
+		EQ *pt = hpsat_gf2_term(row, false);
+
+		TAILQ_INSERT_BEFORE(peq, pt, entry);
+		delete peq->remove(&f.pe->head);
+		any = true;
 	}
 	return (any);
 }
@@ -124,17 +515,16 @@ bool
 hpsat_simplify(EQ &eq)
 {
 	const hpsat_var_t vm = eq.maxVar() + 1;
-	EQP *ppeq = new EQP [vm];
+	hpsat_gf2_ctx ctx;
 	bool any = false;
 
-	memset(ppeq, 0, sizeof(ppeq[0]) * vm);
+	ctx.pivot.assign(vm, SIZE_MAX);
+	ctx.column.assign(vm, 0);
+	ctx.mark.assign(vm, 0);
 
-	while (eq.simplify(ppeq)) {
+	while (hpsat_gf2_simplify(eq, ctx)) {
 		eq.sort();
 		any = true;
 	}
-
-	delete [] ppeq;
-
 	return (any);
 }
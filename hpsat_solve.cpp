@@ -25,94 +25,1004 @@
 
 #include "hpsat.h"
 
-bool
-EQ :: solve(uint8_t *pvar, hpsat_var_t vmax, eq_solve_cb_t *cb, void *arg)
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+/*
+ * The top-level terms are split into components which share no
+ * variables. Each component is given its own range of positions in
+ * the elimination sequence, twice its number of variables, so that
+ * every variable can be postponed once. Components are eliminated
+ * independently, and in parallel when there are several.
+ */
+
+struct hpsat_comp {
+	size_t start;
+	size_t num;
+	size_t nseq;
+	size_t nresid;
+	int result;
+};
+
+struct hpsat_solve_ctx {
+	EQ *pbucket;
+	EQ *pzero;
+	EQ *pone;
+	hpsat_var_t *pseq;
+	hpsat_var_t *prank;
+	hpsat_var_t vmax;
+	size_t nlast;
+	size_t budget;
+	hpsat_comp *pcomp;
+	size_t ncomp;
+	std::atomic<bool> stop;
+};
+
+static hpsat_var_t
+hpsat_solve_min(const EQ &eq, const hpsat_var_t *prank, hpsat_var_t vmax)
 {
-	if (vmax < HPSAT_VAR_MIN)
-		return (false);
+	hpsat_stack<const EQ *> stack;
+	hpsat_var_t retval = HPSAT_VAR_MAX;
 
-	bool retval;
+	stack.push(&eq);
 
-	EQ *pone = new EQ [vmax];
-	EQ *pzero = new EQ [vmax];
+	while (!stack.empty()) {
+		const EQ *pe = stack.top();
 
-	memset(pvar, 0, sizeof(pvar[0]) * vmax);
+		stack.pop();
 
-	for (hpsat_var_t v = HPSAT_VAR_MIN; v != vmax; v++) {
+		switch (pe->var) {
+		case HPSAT_VAR_ZERO:
+		case HPSAT_VAR_ONE:
+			break;
+		case HPSAT_VAR_ORED:
+		case HPSAT_VAR_XORED:
+		case HPSAT_VAR_ANDED:
+			for (EQ *peq = pe->first(); peq; peq = peq->next()) {
+				if (peq->first() != 0)
+					stack.push(peq);
+				else if (peq->var >= HPSAT_VAR_MIN &&
+				    peq->var < vmax &&
+				    prank[peq->var] < retval)
+					retval = prank[peq->var];
+			}
+			break;
+		default:
+			if (pe->var < vmax && prank[pe->var] < retval)
+				retval = prank[pe->var];
+			break;
+		}
+	}
+	return (retval);
+}
+
+/*
+ * Split a detached expression into its terms, flattening nested OR
+ * groups, and pass each term to "fn". Constant terms are freed.
+ * Returns true if any of them was a constant one.
+ */
+template <typename F>
+static bool
+hpsat_solve_terms(EQ *pe, F fn)
+{
+	hpsat_stack<EQ *> stack;
+	bool one = false;
+
+	while (1) {
+		switch (pe->var) {
+		case HPSAT_VAR_ZERO:
+			delete pe;
+			break;
+		case HPSAT_VAR_ONE:
+			delete pe;
+			one = true;
+			break;
+		case HPSAT_VAR_ORED:
+			stack.push(pe);
+			break;
+		default:
+			fn(pe);
+			break;
+		}
+
+		/* get the next term of the innermost OR group */
+		for (pe = 0; !stack.empty(); stack.pop()) {
+			EQ *pg = stack.top();
+
+			if ((pe = pg->first()) != 0) {
+				pe->remove(&pg->head);
+				break;
+			}
+			delete pg;
+		}
+		if (pe == 0)
+			return (one);
+	}
+}
+
+/*
+ * Insert a detached term into the bucket of its first variable in
+ * elimination order. The last bucket collects terms which have no
+ * variable below "vmax". A constant one term makes the component
+ * unsatisfiable.
+ */
+static void
+hpsat_solve_insert(EQ *pe, hpsat_solve_ctx &ctx, hpsat_comp &comp)
+{
+	const bool one = hpsat_solve_terms(pe, [&](EQ *pt) {
+		hpsat_var_t v = hpsat_solve_min(*pt, ctx.prank, ctx.vmax);
+
+		if (v > ctx.nlast)
+			v = ctx.nlast;
+		pt->insert_tail(&ctx.pbucket[v].head);
+		comp.nresid += pt->nodes;
+	});
+
+	if (one)
+		comp.result = HPSAT_UNSAT;
+}
+
+static EQ *
+hpsat_solve_remove(EQ *pe, hpsat_solve_ctx &ctx, hpsat_comp &comp, size_t x)
+{
+	comp.nresid -= pe->nodes;
+	return (pe->remove(&ctx.pbucket[x].head));
+}
+
+static hpsat_var_t
+hpsat_find(hpsat_var_t *pparent, hpsat_var_t v)
+{
+	while (pparent[v] != v) {
+		pparent[v] = pparent[pparent[v]];
+		v = pparent[v];
+	}
+	return (v);
+}
+
+static void
+hpsat_union(const EQ &eq, const hpsat_solve_ctx &ctx, hpsat_var_t *pparent,
+    hpsat_var_t &first)
+{
+	hpsat_stack<const EQ *> stack;
+
+	stack.push(&eq);
+
+	while (!stack.empty()) {
+		const EQ *pe = stack.top();
+
+		stack.pop();
+
+		switch (pe->var) {
+		case HPSAT_VAR_ZERO:
+		case HPSAT_VAR_ONE:
+			break;
+		case HPSAT_VAR_ORED:
+		case HPSAT_VAR_XORED:
+		case HPSAT_VAR_ANDED:
+			for (EQ *peq = pe->first(); peq; peq = peq->next())
+				stack.push(peq);
+			break;
+		default:
+			if (pe->var >= ctx.vmax)
+				break;
+			if (first == HPSAT_VAR_MAX)
+				first = hpsat_find(pparent, pe->var);
+			else
+				pparent[hpsat_find(pparent, pe->var)] = first;
+			break;
+		}
+	}
+}
+
+/*
+ * Split the terms, which are initially bucketed in the order given
+ * by "porder", into components and lay out the elimination sequence
+ * per component. Components are ordered by their first variable.
+ * Variables above "vmax" are not joined, so the expression must not
+ * have any, else terms sharing them would share the last bucket.
+ * Returns the number of components having terms.
+ */
+static size_t
+hpsat_solve_split(hpsat_solve_ctx &ctx, const hpsat_var_t *porder)
+{
+	const hpsat_var_t vmax = ctx.vmax;
+	const size_t nvars = vmax - HPSAT_VAR_MIN;
+	hpsat_var_t *pparent = new hpsat_var_t [vmax];
+	size_t *pindex = new size_t [vmax];
+	size_t nused = 0;
+	EQ_HEAD_t temp;
+	EQ *pe;
+
+	for (hpsat_var_t v = 0; v != vmax; v++) {
+		pparent[v] = v;
+		pindex[v] = SIZE_MAX;
+	}
+
+	for (size_t x = 0; x != nvars; x++) {
+		for (pe = ctx.pbucket[x].first(); pe; pe = pe->next()) {
+			hpsat_var_t first = HPSAT_VAR_MAX;
+			hpsat_union(*pe, ctx, pparent, first);
+		}
+	}
+
+	/* number the components */
+	ctx.ncomp = 0;
+	for (size_t x = 0; x != nvars; x++) {
+		const hpsat_var_t r = hpsat_find(pparent, porder[x]);
+
+		if (pindex[r] == SIZE_MAX) {
+			pindex[r] = ctx.ncomp++;
+			ctx.pcomp[pindex[r]].num = 0;
+			ctx.pcomp[pindex[r]].nresid = 0;
+			ctx.pcomp[pindex[r]].result = HPSAT_SAT;
+		}
+		ctx.pcomp[pindex[r]].num++;
+	}
+
+	for (size_t x = 0, start = 0; x != ctx.ncomp; x++) {
+		ctx.pcomp[x].start = start;
+		ctx.pcomp[x].nseq = 0;
+		start += 2 * ctx.pcomp[x].num;
+	}
+
+	/* lay out the sequence, keeping the given order */
+	for (size_t x = 0; x != 2 * nvars; x++)
+		ctx.pseq[x] = HPSAT_VAR_MAX;
+
+	for (size_t x = 0; x != nvars; x++) {
+		const hpsat_var_t v = porder[x];
+		hpsat_comp &comp = ctx.pcomp[pindex[hpsat_find(pparent, v)]];
+		const size_t pos = comp.start + comp.nseq++;
+
+		ctx.pseq[pos] = v;
+		ctx.prank[v] = pos;
+	}
+
+	/* re-bucket all terms */
+	TAILQ_INIT(&temp);
+	for (size_t x = 0; x != nvars; x++) {
+		while ((pe = ctx.pbucket[x].first()))
+			pe->remove(&ctx.pbucket[x].head)->insert_tail(&temp);
+	}
+
+	while ((pe = TAILQ_FIRST(&temp))) {
+		const hpsat_var_t v =
+		    ctx.pseq[hpsat_solve_min(*pe, ctx.prank, ctx.vmax)];
+		hpsat_comp &comp = ctx.pcomp[pindex[hpsat_find(pparent, v)]];
+
+		pe->remove(&temp);
+		if (comp.nresid == 0)
+			nused++;
+		hpsat_solve_insert(pe, ctx, comp);
+	}
+
+	delete [] pparent;
+	delete [] pindex;
+
+	return (nused);
+}
+
+/*
+ * Compute both cofactors of all terms containing "v". Large sets of
+ * terms are expanded in parallel. The terms are expanded in place
+ * into the one cofactor, unless "keep" is set.
+ */
+
+#define	HPSAT_SOLVE_PARALLEL (1UL << 14)	/* nodes */
+
+struct hpsat_expand_ctx {
+	EQ **pterm;
+	EQ **pzero;
+	EQ **pone;
+	size_t num;
+	size_t nwork;
+	hpsat_var_t v;
+	bool keep;
+};
+
+static void
+hpsat_expand_work(size_t index, void *arg)
+{
+	hpsat_expand_ctx &ctx = *(hpsat_expand_ctx *)arg;
+	const size_t end = ((index + 1) * ctx.num) / ctx.nwork;
+
+	for (size_t x = (index * ctx.num) / ctx.nwork; x != end; x++) {
+		EQ *pe = ctx.pterm[x];
+
+		ctx.pzero[x] = &pe->dup()->expand(ctx.v, false);
+		ctx.pone[x] = &(ctx.keep ? pe->dup() : pe)->expand(ctx.v, true);
+	}
+}
+
+static void
+hpsat_solve_expand(EQ **pterm, size_t num, size_t nodes, hpsat_var_t v,
+    bool keep, EQ &zero, EQ &one)
+{
+	hpsat_expand_ctx ctx;
+
+	ctx.pterm = pterm;
+	ctx.pzero = new EQ * [2 * num];
+	ctx.pone = ctx.pzero + num;
+	ctx.num = num;
+	ctx.v = v;
+	ctx.keep = keep;
+
+	if (nodes >= HPSAT_SOLVE_PARALLEL) {
+		ctx.nwork = 4 * hpsat_nthreads();
+		if (ctx.nwork > num)
+			ctx.nwork = num;
+		hpsat_parallel(ctx.nwork, &hpsat_expand_work, &ctx);
+	} else if (num != 0) {
+		ctx.nwork = 1;
+		hpsat_expand_work(0, &ctx);
+	}
+
+	for (size_t x = 0; x != num; x++) {
+		ctx.pzero[x]->insert_tail(&zero.head);
+		ctx.pone[x]->insert_tail(&one.head);
+	}
+
+	delete [] ctx.pzero;
+}
+
+/*
+ * Eliminate all variables of one component.
+ */
+static void
+hpsat_solve_elim(size_t index, void *arg)
+{
+	hpsat_solve_ctx &ctx = *(hpsat_solve_ctx *)arg;
+	hpsat_comp &comp = ctx.pcomp[index];
+	std::vector<EQ *> term;
+	size_t nodes;
+
+	/*
+	 * Variables are eliminated in sequence, so all remaining terms
+	 * containing "v" are found in the bucket of its position.
+	 */
+	for (size_t x = comp.start; x != comp.start + comp.nseq; x++) {
+		const hpsat_var_t v = ctx.pseq[x];
+		EQ &zero = ctx.pzero[v];
+		EQ &one = ctx.pone[v];
 		EQ *pe;
-		EQ *pn;
 
-		if (var == HPSAT_VAR_ORED) {
-			for (pe = first(); pe; pe = pn) {
-				pn = pe->next();
+		/* stop as soon as the result is constant */
+		if (comp.result != HPSAT_SAT || comp.nresid == 0 ||
+		    ctx.stop.load(std::memory_order_relaxed))
+			break;
+		if (v == HPSAT_VAR_MAX)
+			continue;
+
+		term.clear();
+		nodes = 0;
+		for (pe = ctx.pbucket[x].first(); pe; pe = pe->next()) {
+			term.push_back(pe);
+			nodes += pe->nodes;
+		}
+		if (ctx.budget == 0) {
+			for (EQ *pt : term)
+				hpsat_solve_remove(pt, ctx, comp, x);
+		}
+		hpsat_solve_expand(term.data(), term.size(), nodes, v,
+		    ctx.budget != 0, zero, one);
+
+		zero.var = HPSAT_VAR_ORED;
+		one.var = HPSAT_VAR_ORED;
+
+		zero.sort();
+		one.sort();
 
-				if (pe->contains(v)) {
-					pe->remove(&head);
-					pe->dup()->expand(v, false).insert_tail(&pzero[v].head);
-					pe->expand(v, true).insert_tail(&pone[v].head);
+		EQ *pc = new EQ(zero & one);
+
+		if (ctx.budget != 0) {
+			if (comp.nresid - nodes + pc->nodes > ctx.budget) {
+				delete pc;
+				zero = EQ();
+				one = EQ();
+
+				if (x >= comp.start + comp.num) {
+					comp.result = HPSAT_UNKNOWN;
+					break;
+				}
+
+				/* postpone the variable */
+				ctx.prank[v] = comp.start + comp.nseq;
+				ctx.pseq[comp.start + comp.nseq++] = v;
+				ctx.pseq[x] = HPSAT_VAR_MAX;
+
+				while ((pe = ctx.pbucket[x].first())) {
+					hpsat_solve_remove(pe, ctx, comp, x);
+					hpsat_solve_insert(pe, ctx, comp);
 				}
+				continue;
 			}
-			pzero[v].var = var;
-			pone[v].var = var;
-		} else {
-			pzero[v] = EQ(*this).expand(v, false);
-			pone[v] = EQ(*this).expand(v, true);
-			*this = EQ();
-		}
 
-		pzero[v].sort();
-		pone[v].sort();
+			while ((pe = ctx.pbucket[x].first()))
+				delete hpsat_solve_remove(pe, ctx, comp, x);
+		}
 
 		/* add remaining conflicts */
-		*this |= (pzero[v] & pone[v]);
+		hpsat_solve_insert(pc, ctx, comp);
 	}
 
-	/* check if there is no solution */
-	if (var != HPSAT_VAR_ZERO) {
-		retval = false;
-		goto done;
+	if (comp.result != HPSAT_SAT)
+		ctx.stop = true;
+}
+
+struct hpsat_compile_ctx {
+	const EQ *pzero;
+	const EQ *pone;
+	EQC *pczero;
+	EQC *pcone;
+	hpsat_var_t vmax;
+	size_t nwork;
+};
+
+static void
+hpsat_compile_work(size_t index, void *arg)
+{
+	hpsat_compile_ctx &ctx = *(hpsat_compile_ctx *)arg;
+	const size_t n = ctx.vmax - HPSAT_VAR_MIN;
+	const size_t start = HPSAT_VAR_MIN + (index * n) / ctx.nwork;
+	const size_t end = HPSAT_VAR_MIN + ((index + 1) * n) / ctx.nwork;
+
+	for (size_t x = start; x != end; x++) {
+		ctx.pczero[x].compile(ctx.pzero[x]);
+		ctx.pcone[x].compile(ctx.pone[x]);
 	}
+}
+
+/*
+ * Build the elimination sequence from a user supplied order. Variables
+ * out of range or given twice are ignored, and missing variables are
+ * appended in increasing order.
+ */
+static void
+hpsat_solve_order(const hpsat_var_t *porder, hpsat_var_t vmax,
+    hpsat_var_t *pseq, hpsat_var_t *prank)
+{
+	const size_t nvars = vmax - HPSAT_VAR_MIN;
+	size_t n = 0;
+
+	for (hpsat_var_t v = 0; v != vmax; v++)
+		prank[v] = nvars;
+
+	for (size_t x = 0; porder != 0 && x != nvars; x++) {
+		const hpsat_var_t v = porder[x];
+
+		if (v < HPSAT_VAR_MIN || v >= vmax || prank[v] != nvars)
+			continue;
+		prank[v] = n;
+		pseq[n++] = v;
+	}
+
+	for (hpsat_var_t v = HPSAT_VAR_MIN; v != vmax; v++) {
+		if (prank[v] != nvars)
+			continue;
+		prank[v] = n;
+		pseq[n++] = v;
+	}
+}
+
+/*
+ * Back-substitute in reverse elimination order, given the compiled
+ * cofactors of all variables, and optionally enumerate all solutions.
+ * The sequence may have holes, marked by HPSAT_VAR_MAX. The components
+ * are laid out one after another in the sequence, so the partial
+ * models of all components are merged into "pvar" by going over the
+ * whole sequence.
+ */
+static int
+hpsat_solve_back(uint8_t *pvar, hpsat_var_t vmax, const hpsat_var_t *pseq,
+    size_t nseq, const EQC *pczero, const EQC *pcone, eq_solve_cb_t *cb,
+    void *arg)
+{
 top:
-	for (hpsat_var_t v = vmax; v-- != HPSAT_VAR_MIN; ) {
+	for (size_t x = nseq; x-- != 0; ) {
+		const hpsat_var_t v = pseq[x];
+
+		if (v == HPSAT_VAR_MAX)
+			continue;
 		if (pvar[v] == 0) {
-			if (pzero[v].expand_all(pvar))
+			if (pczero[v].eval(pvar))
 				pvar[v] = 1;
 		}
 		if (pvar[v] == 1) {
-			if (pone[v].expand_all(pvar))
+			if (pcone[v].eval(pvar))
 				pvar[v] = 2;
 		}
 	}
 
 	for (hpsat_var_t v = HPSAT_VAR_MIN; v != vmax; v++) {
-		if (pvar[v] == 2) {
-			retval = false;
-			goto done;
-		}
+		if (pvar[v] == 2)
+			return (HPSAT_UNSAT);
 	}
 
-	if (cb) {
-		if (cb(pvar, arg)) {
-			retval = true;
-			goto done;
-		}
+	if (cb == 0)
+		return (HPSAT_SAT);
+	if (cb(pvar, arg))
+		return (HPSAT_SAT);
 
-		for (hpsat_var_t v = HPSAT_VAR_MIN; v != vmax; v++) {
-			if (pvar[v] == 0) {
-				pvar[v] = 1;
+	for (size_t x = 0; x != nseq; x++) {
+		const hpsat_var_t v = pseq[x];
 
-				if (!pone[v].expand_all(pvar))
-					goto top;
-			}
-			pvar[v] = 0;
+		if (v == HPSAT_VAR_MAX)
+			continue;
+		if (pvar[v] == 0) {
+			pvar[v] = 1;
+
+			if (!pcone[v].eval(pvar))
+				goto top;
 		}
-		retval = false;
+		pvar[v] = 0;
+	}
+	return (HPSAT_UNSAT);
+}
+
+/*
+ * Find an assignment which makes the expression zero, eliminating
+ * variables in the given order. If "budget" is non-zero, a variable
+ * whose elimination would grow the residual expression beyond
+ * "budget" nodes is postponed to the end of the order once. If that
+ * is not enough, HPSAT_UNKNOWN is returned and the expression is left
+ * as is.
+ */
+int
+EQ :: solve(uint8_t *pvar, hpsat_var_t vmax, eq_solve_cb_t *cb, void *arg,
+    const hpsat_var_t *porder, size_t budget)
+{
+	if (vmax < HPSAT_VAR_MIN)
+		return (HPSAT_UNSAT);
+
+	const size_t nvars = vmax - HPSAT_VAR_MIN;
+	const size_t nseq = 2 * nvars;
+	hpsat_solve_ctx ctx;
+	hpsat_comp whole;
+	size_t nused;
+	bool one = false;
+	bool unknown = false;
+	int retval;
+
+	EQ *pone = new EQ [vmax];
+	EQ *pzero = new EQ [vmax];
+	/* each variable can be postponed once */
+	EQ *pbucket = new EQ [nseq + 1];
+	hpsat_var_t *pseq = new hpsat_var_t [nseq];
+	hpsat_var_t *pinit = new hpsat_var_t [nvars];
+	hpsat_var_t *prank = new hpsat_var_t [vmax];
+	hpsat_comp *pcomp = new hpsat_comp [nvars + 1];
+	EQC *pcone = 0;
+	EQC *pczero = 0;
+	EQ_ARENA arena;
+	EQ_ARENA *pold;
+
+	memset(pvar, 0, sizeof(pvar[0]) * vmax);
+
+	hpsat_solve_order(porder, vmax, pinit, prank);
+
+	ctx.pbucket = pbucket;
+	ctx.pzero = pzero;
+	ctx.pone = pone;
+	ctx.pseq = pseq;
+	ctx.prank = prank;
+	ctx.vmax = vmax;
+	ctx.nlast = nseq;
+	ctx.budget = budget;
+	ctx.pcomp = pcomp;
+	ctx.ncomp = 0;
+	ctx.stop = false;
+
+	whole.start = 0;
+	whole.num = nvars;
+	whole.nseq = nvars;
+	whole.nresid = 0;
+	whole.result = HPSAT_SAT;
+
+	/* move the expression into a private arena */
+	pold = hpsat_arena_set(&arena);
+	hpsat_solve_insert(new EQ(*this), ctx, whole);
+
+	if (whole.result != HPSAT_SAT) {
+		one = true;
+	} else if (maxVar() < vmax && pbucket[nseq].first() == 0) {
+		nused = hpsat_solve_split(ctx, pinit);
+
+		/* run the components in parallel, if more than one */
+		if (nused > 1)
+			hpsat_parallel(ctx.ncomp, &hpsat_solve_elim, &ctx);
+		else
+			for (size_t x = 0; x != ctx.ncomp; x++)
+				hpsat_solve_elim(x, &ctx);
 	} else {
-		retval = true;
+		/* variables above "vmax" can not be split into components */
+		for (size_t x = 0; x != nseq; x++)
+			pseq[x] = (x < nvars) ?
+			    pinit[x] : (hpsat_var_t)HPSAT_VAR_MAX;
+		pcomp[0] = whole;
+		ctx.ncomp = 1;
+		hpsat_solve_elim(0, &ctx);
 	}
+
+	hpsat_arena_set(pold);
+
+	for (size_t x = 0; x != ctx.ncomp; x++) {
+		if (pcomp[x].result == HPSAT_UNSAT)
+			one = true;
+		else if (pcomp[x].result == HPSAT_UNKNOWN)
+			unknown = true;
+	}
+
+	if (unknown && !one) {
+		retval = HPSAT_UNKNOWN;
+		goto done;
+	}
+
+	/*
+	 * Keep the residual, which is constant unless there are variables
+	 * above "vmax".
+	 */
+	if (one) {
+		*this = EQ(HPSAT_VAR_ONE);
+	} else {
+		EQ rest(HPSAT_VAR_ORED);
+
+		for (EQ *pe = pbucket[nseq].first(); pe; pe = pe->next())
+			pe->dup()->insert_tail(&rest.head);
+		*this = rest.sort();
+	}
+
+	/* check if there is no solution */
+	if (var != HPSAT_VAR_ZERO) {
+		retval = HPSAT_UNSAT;
+		goto done;
+	}
+
+	/* compile all cofactors for back-substitution */
+	pcone = new EQC [vmax];
+	pczero = new EQC [vmax];
+
+	if (nvars != 0) {
+		hpsat_compile_ctx cc;
+
+		cc.pzero = pzero;
+		cc.pone = pone;
+		cc.pczero = pczero;
+		cc.pcone = pcone;
+		cc.vmax = vmax;
+		cc.nwork = 4 * hpsat_nthreads();
+		if (cc.nwork > nvars)
+			cc.nwork = nvars;
+
+		hpsat_parallel(cc.nwork, &hpsat_compile_work, &cc);
+	}
+
+	retval = hpsat_solve_back(pvar, vmax, pseq, nseq, pczero, pcone,
+	    cb, arg);
 done:
+	/* all nodes are released at once by the arena */
+	for (hpsat_var_t v = 0; v != vmax; v++) {
+		TAILQ_INIT(&pzero[v].head);
+		TAILQ_INIT(&pone[v].head);
+	}
+	for (size_t x = 0; x != nseq + 1; x++)
+		TAILQ_INIT(&pbucket[x].head);
 	delete [] pzero;
 	delete [] pone;
+	delete [] pbucket;
+	delete [] pseq;
+	delete [] pinit;
+	delete [] prank;
+	delete [] pcomp;
+	delete [] pczero;
+	delete [] pcone;
 
 	return (retval);
 }
+
+/*
+ * The incremental solver keeps the cofactors of every variable. New
+ * terms are eliminated in order, but only at the variables they reach:
+ * the new cofactors "tz" and "to" are ORed into the stored ones, "Z"
+ * and "O", and only the part of the resolvent which is new,
+ * (tz & (O | to)) | (Z & to), is passed on. Variables first seen by
+ * add() are appended to the elimination order.
+ */
+EQ_SOLVER :: EQ_SOLVER(hpsat_var_t _vmax, const hpsat_var_t *porder)
+{
+	if (_vmax < HPSAT_VAR_MIN)
+		_vmax = HPSAT_VAR_MIN;
+
+	vmax = _vmax;
+	valloc = _vmax;
+	undo_unsat = false;
+	assuming = false;
+	unsat = false;
+
+	pzero = new EQ [valloc];
+	pone = new EQ [valloc];
+	ppend = new EQ [valloc];
+	pczero = new EQC [valloc];
+	pcone = new EQC [valloc];
+	pdirty = new uint8_t [valloc];
+	pseq = new hpsat_var_t [valloc];
+	prank = new hpsat_var_t [valloc];
+
+	memset(pdirty, 0, sizeof(pdirty[0]) * valloc);
+	hpsat_solve_order(porder, vmax, pseq, prank);
+}
+
+EQ_SOLVER :: ~EQ_SOLVER()
+{
+	delete [] pzero;
+	delete [] pone;
+	delete [] ppend;
+	delete [] pczero;
+	delete [] pcone;
+	delete [] pdirty;
+	delete [] pseq;
+	delete [] prank;
+}
+
+void
+EQ_SOLVER :: grow(hpsat_var_t _vmax)
+{
+	if (_vmax <= vmax)
+		return;
+
+	if (_vmax > valloc) {
+		hpsat_var_t n = 2 * valloc;
+
+		if (n < _vmax)
+			n = _vmax;
+
+		EQ *pz = new EQ [n];
+		EQ *po = new EQ [n];
+		EQ *pp = new EQ [n];
+		EQC *pcz = new EQC [n];
+		EQC *pco = new EQC [n];
+		uint8_t *pd = new uint8_t [n];
+		hpsat_var_t *ps = new hpsat_var_t [n];
+		hpsat_var_t *pr = new hpsat_var_t [n];
+
+		for (hpsat_var_t v = 0; v != vmax; v++) {
+			pz[v] = pzero[v];
+			po[v] = pone[v];
+			pcz[v].swap(pczero[v]);
+			pco[v].swap(pcone[v]);
+			pd[v] = pdirty[v];
+			ps[v] = pseq[v];
+			pr[v] = prank[v];
+		}
+
+		delete [] pzero;
+		delete [] pone;
+		delete [] ppend;
+		delete [] pczero;
+		delete [] pcone;
+		delete [] pdirty;
+		delete [] pseq;
+		delete [] prank;
+
+		pzero = pz;
+		pone = po;
+		ppend = pp;
+		pczero = pcz;
+		pcone = pco;
+		pdirty = pd;
+		pseq = ps;
+		prank = pr;
+		valloc = n;
+	}
+
+	/* new variables are eliminated last */
+	for (hpsat_var_t v = vmax; v != _vmax; v++) {
+		pdirty[v] = 0;
+		prank[v] = v - HPSAT_VAR_MIN;
+		pseq[v - HPSAT_VAR_MIN] = v;
+	}
+	vmax = _vmax;
+}
+
+void
+EQ_SOLVER :: insert(EQ *pe)
+{
+	const bool one = hpsat_solve_terms(pe, [&](EQ *pt) {
+		const size_t x = hpsat_solve_min(*pt, prank, vmax);
+
+		if (ppend[x].first() == 0) {
+			queue.push_back(x);
+			std::push_heap(queue.begin(), queue.end(),
+			    std::greater<size_t>());
+		}
+		pt->insert_tail(&ppend[x].head);
+	});
+
+	if (one)
+		unsat = true;
+}
+
+void
+EQ_SOLVER :: propagate(void)
+{
+	EQ *pe;
+
+	while (queue.empty() == false) {
+		std::pop_heap(queue.begin(), queue.end(),
+		    std::greater<size_t>());
+
+		const size_t x = queue.back();
+		const hpsat_var_t v = pseq[x];
+		EQ tz(HPSAT_VAR_ORED);
+		EQ to(HPSAT_VAR_ORED);
+
+		queue.pop_back();
+
+		while ((pe = ppend[x].first())) {
+			pe->remove(&ppend[x].head);
+			pe->dup()->expand(v, false).insert_tail(&tz.head);
+			pe->expand(v, true).insert_tail(&to.head);
+		}
+
+		tz.sort();
+		to.sort();
+
+		/* keep the cofactors, so that assumptions can be undone */
+		if (assuming && (pdirty[v] & 2) == 0) {
+			pdirty[v] |= 2;
+			undo_var.push_back(v);
+			undo_eq.push_back(pzero[v].dup());
+			undo_eq.push_back(pone[v].dup());
+		}
+
+		pone[v] |= to;
+
+		EQ *pc = new EQ(pzero[v] & std::move(to));
+
+		pzero[v] |= tz;
+		*pc |= std::move(tz) & pone[v];
+		pdirty[v] |= 1;
+
+		/* the resolvent only has variables later in the order */
+		insert(pc);
+	}
+}
+
+EQ_SOLVER &
+EQ_SOLVER :: add(const EQ &eq)
+{
+	if (unsat)
+		return (*this);
+
+	grow(eq.maxVar() + 1);
+	insert(&eq.dup()->sort());
+	propagate();
+	return (*this);
+}
+
+/*
+ * Find an assignment which makes all added terms zero. Only the
+ * cofactors which changed since the last call are compiled again.
+ * The "pvar" array must have room for maxVar() + 1 entries.
+ */
+int
+EQ_SOLVER :: solve(uint8_t *pvar, eq_solve_cb_t *cb, void *arg)
+{
+	memset(pvar, 0, sizeof(pvar[0]) * vmax);
+
+	if (unsat)
+		return (HPSAT_UNSAT);
+
+	for (hpsat_var_t v = HPSAT_VAR_MIN; v != vmax; v++) {
+		if ((pdirty[v] & 1) == 0)
+			continue;
+		pdirty[v] &= ~1;
+		pczero[v].compile(pzero[v]);
+		pcone[v].compile(pone[v]);
+	}
+	return (hpsat_solve_back(pvar, vmax, pseq, vmax - HPSAT_VAR_MIN,
+	    pczero, pcone, cb, arg));
+}
+
+/*
+ * Add the assumptions as unit terms, until the terms become
+ * unsatisfiable. A positive literal "v" assumes that variable "v" is
+ * one, and a negative literal that it is zero. Variables above
+ * maxVar() are not in any term, and are ignored. Returns the number
+ * of assumptions added.
+ */
+size_t
+EQ_SOLVER :: assume(const ssize_t *passume, size_t nassume)
+{
+	size_t x;
+
+	undo_unsat = unsat;
+	assuming = true;
+
+	for (x = 0; x != nassume && unsat == false; x++) {
+		const hpsat_var_t v =
+		    (passume[x] < 0) ? -passume[x] : passume[x];
+
+		if (v < HPSAT_VAR_MIN || v >= vmax)
+			continue;
+
+		EQ *pe = new EQ(v);
+
+		if (passume[x] > 0)
+			*pe ^= EQ(HPSAT_VAR_ONE);
+		insert(pe);
+		propagate();
+	}
+	return (x);
+}
+
+/* restore the cofactors changed since assume() */
+void
+EQ_SOLVER :: undo(void)
+{
+	for (size_t x = 0; x != undo_var.size(); x++) {
+		const hpsat_var_t v = undo_var[x];
+
+		pzero[v] = *undo_eq[2 * x];
+		pone[v] = *undo_eq[2 * x + 1];
+		delete undo_eq[2 * x];
+		delete undo_eq[2 * x + 1];
+		pdirty[v] = 1;
+	}
+	undo_var.clear();
+	undo_eq.clear();
+	unsat = undo_unsat;
+	assuming = false;
+}
+
+/*
+ * Solve under the given assumptions, without changing the added
+ * terms. If the assumptions make the terms unsatisfiable, a subset of
+ * them which does so is stored in "pfailed". Each of the failed
+ * assumptions is needed, but the subset is not necessarily the
+ * smallest one. The subset is empty when the terms are unsatisfiable
+ * by themselves.
+ */
+int
+EQ_SOLVER :: solve(uint8_t *pvar, const ssize_t *passume, size_t nassume,
+    std::vector<ssize_t> *pfailed, eq_solve_cb_t *cb, void *arg)
+{
+	std::vector<ssize_t> core;
+	std::vector<ssize_t> temp;
+	size_t n;
+	int retval;
+
+	if (pfailed != 0)
+		pfailed->clear();
+	if (unsat)
+		return (solve(pvar, cb, arg));
+
+	n = assume(passume, nassume);
+
+	if (unsat == false) {
+		retval = solve(pvar, cb, arg);
+		undo();
+		return (retval);
+	}
+	undo();
+
+	memset(pvar, 0, sizeof(pvar[0]) * vmax);
+
+	if (pfailed == 0)
+		return (HPSAT_UNSAT);
+
+	/* the last assumption added is needed, try to drop the others */
+	core.assign(passume, passume + n);
+
+	for (size_t x = n - 1; x-- != 0; ) {
+		temp = core;
+		temp.erase(temp.begin() + x);
+
+		assume(temp.data(), temp.size());
+		if (unsat)
+			core.swap(temp);
+		undo();
+	}
+	pfailed->swap(core);
+	return (HPSAT_UNSAT);
+}
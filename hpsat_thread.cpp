@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2023 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hpsat.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+/*
+ * Simple fork-join thread pool. Work items are handed out one by one
+ * from a shared counter, so that idle threads pick up the remaining
+ * work. The calling thread takes part in the work. Nested calls from
+ * within a worker, and calls made while the pool is busy, are run
+ * serially. Workers allocate EQ nodes from a child of the caller's
+ * arena, if any, so that the caller can release all nodes at once.
+ * Each worker has its own child, which is reused by later jobs, so
+ * that nodes freed by a worker are allocated again.
+ */
+
+struct hpsat_job {
+	hpsat_work_t *fn;
+	void *arg;
+	size_t num;
+	EQ_ARENA *parena;
+	std::atomic<size_t> index;
+};
+
+struct hpsat_pool {
+	std::mutex mtx;
+	std::mutex busy;
+	std::condition_variable wakeup;
+	std::condition_variable done;
+	hpsat_job *pjob;
+	uint64_t gen;
+	size_t active;
+	size_t nworkers;
+};
+
+static thread_local bool hpsat_in_worker;
+static hpsat_pool *hpsat_pool_ptr;
+static std::once_flag hpsat_pool_once;
+
+size_t
+hpsat_nthreads(void)
+{
+	static const size_t n = std::thread::hardware_concurrency();
+
+	return (n ? n : 1);
+}
+
+static void
+hpsat_job_run(hpsat_job &job)
+{
+	const bool was = hpsat_in_worker;
+	size_t x;
+
+	hpsat_in_worker = true;
+	while ((x = job.index.fetch_add(1)) < job.num)
+		job.fn(x, job.arg);
+	hpsat_in_worker = was;
+}
+
+static void
+hpsat_pool_worker(hpsat_pool *pp, size_t index)
+{
+	uint64_t gen = 0;
+
+	for (;;) {
+		std::unique_lock<std::mutex> lock(pp->mtx);
+
+		pp->wakeup.wait(lock, [&]() { return (pp->gen != gen); });
+		gen = pp->gen;
+
+		hpsat_job *pjob = pp->pjob;
+
+		/* the job may already be finished */
+		if (pjob == 0)
+			continue;
+		pp->active++;
+		lock.unlock();
+
+		EQ_ARENA *pold = hpsat_arena_set(pjob->parena ?
+		    pjob->parena->child(index) : 0);
+		hpsat_job_run(*pjob);
+		hpsat_arena_set(pold);
+
+		lock.lock();
+		if (--(pp->active) == 0)
+			pp->done.notify_all();
+	}
+}
+
+static void
+hpsat_pool_init(void)
+{
+	/* the pool lives until the process exits */
+	hpsat_pool *pp = new hpsat_pool();
+
+	pp->pjob = 0;
+	pp->gen = 0;
+	pp->active = 0;
+	pp->nworkers = hpsat_nthreads() - 1;
+
+	for (size_t x = 0; x != pp->nworkers; x++)
+		std::thread(hpsat_pool_worker, pp, x).detach();
+
+	hpsat_pool_ptr = pp;
+}
+
+void
+hpsat_parallel(size_t num, hpsat_work_t *fn, void *arg)
+{
+	if (num <= 1 || hpsat_in_worker || hpsat_nthreads() <= 1) {
+		for (size_t x = 0; x != num; x++)
+			fn(x, arg);
+		return;
+	}
+
+	std::call_once(hpsat_pool_once, &hpsat_pool_init);
+
+	hpsat_pool *pp = hpsat_pool_ptr;
+	std::unique_lock<std::mutex> busy(pp->busy, std::try_to_lock);
+
+	if (!busy.owns_lock()) {
+		for (size_t x = 0; x != num; x++)
+			fn(x, arg);
+		return;
+	}
+
+	hpsat_job job;
+
+	job.fn = fn;
+	job.arg = arg;
+	job.num = num;
+	job.index = 0;
+
+	/* get the current arena, if any */
+	job.parena = hpsat_arena_set(0);
+	hpsat_arena_set(job.parena);
+
+	{
+		std::lock_guard<std::mutex> lock(pp->mtx);
+		pp->pjob = &job;
+		pp->gen++;
+	}
+	pp->wakeup.notify_all();
+
+	hpsat_job_run(job);
+
+	std::unique_lock<std::mutex> lock(pp->mtx);
+	pp->pjob = 0;
+	pp->done.wait(lock, [&]() { return (pp->active == 0); });
+}